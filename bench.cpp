@@ -0,0 +1,573 @@
+#include "treap.h"
+#include <malloc.h>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace dhruvbird::functional;
+
+/**
+ * Micro-benchmarks comparing Treap (with the default and the compact
+ * node layout, the compact layout with TreapPoolAllocator, and key
+ * hashing priorities), MockTreap and std::multiset.
+ *
+ * Usage: ./bench [--min-size=N] [--max-size=N] [--mock-max-size=N]
+ *                [--max-threads=N] [--filter=SUBSTRING]
+ *
+ * Sizes go from --min-size (default 1e3) to --max-size (default 1e6,
+ * up to 1e8) in steps of 10x. MockTreap copies the whole set on every
+ * mutation, so it is only run up to --mock-max-size (default 1e4).
+ *
+ * The atomic_update (writers only) and atomic_mixed (90% readers)
+ * benchmarks share one treap between 1, 2, 4, ... up to
+ * --max-threads (default: the number of CPUs) threads, through an
+ * AtomicTreap with each update policy and through a mutex. The
+ * container column is suffixed with the number of threads.
+ *
+ * Output is CSV on stdout, one row per (benchmark, container, size):
+ *
+ *   benchmark,container,size,ops,total_ns,ns_per_op,bytes_per_element
+ *
+ * bytes_per_element is only reported by the memory benchmark. It
+ * builds each container from random keys and measures the heap
+ * memory that the container holds, counting the size of the malloc
+ * chunk behind every allocation (malloc_usable_size() plus the chunk
+ * header) through a replaced global operator new and delete. It runs
+ * before the other benchmarks and keeps every container it builds
+ * alive until it is done with that kind of container, so that
+ * TreapPoolAllocator can't hand out blocks freed by an earlier build
+ * and has to take all its slabs from malloc.
+ *
+ * The reduce, count_if and filter benchmarks scan a whole Treap on
+ * the calling thread alone ("Treap/seq") and on the default task pool
+ * ("Treap/<threads>t").
+ *
+ * The insert_hinted benchmark inserts nearly sorted keys, hinting
+ * at end() ("Treap/end", "std::multiset/end") or without a hint
+ * ("Treap/none").
+ *
+ * The shape of every treap built by the insert benchmark is printed
+ * to stderr, as
+ *
+ *   [depth: container size height average_depth expected_average_depth]
+ *
+ */
+
+namespace {
+
+  // Heap accounting for the memory benchmark.
+  std::atomic<bool> countHeap(false);
+  std::atomic<long long> heapBytes(0);
+
+  size_t chunkBytes(void *p) {
+    return malloc_usable_size(p) + sizeof(size_t);
+  }
+
+}
+
+void* operator new(size_t size) {
+  void *p = malloc(size ? size : 1);
+  if (!p) throw std::bad_alloc();
+  if (countHeap.load(std::memory_order_relaxed)) {
+    heapBytes.fetch_add(chunkBytes(p), std::memory_order_relaxed);
+  }
+  return p;
+}
+
+void operator delete(void *p) noexcept {
+  if (!p) return;
+  if (countHeap.load(std::memory_order_relaxed)) {
+    heapBytes.fetch_sub(chunkBytes(p), std::memory_order_relaxed);
+  }
+  free(p);
+}
+
+namespace {
+
+  typedef std::chrono::steady_clock Clock;
+
+  struct Options {
+    size_t minSize;
+    size_t maxSize;
+    size_t mockMaxSize;
+    size_t maxThreads;
+    std::string filter;
+  };
+
+  // Accumulates results so that the compiler can't optimize
+  // benchmarked code away.
+  size_t sink = 0;
+
+  const size_t maxQueries = 1000000;
+
+  void report(std::string const &benchmark,
+              std::string const &container, size_t size, size_t ops,
+              Clock::duration elapsed, size_t bytes = 0) {
+    const long long ns =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    cout << benchmark << "," << container << "," << size << "," << ops << ","
+         << ns << "," << (ops ? double(ns) / ops : 0.0) << ",";
+    if (bytes && size) cout << double(bytes) / size;
+    cout << endl;
+  }
+
+  bool enabled(Options const &opts, std::string const &benchmark) {
+    return opts.filter.empty() || benchmark.find(opts.filter) != std::string::npos;
+  }
+
+  std::vector<int> randomKeys(size_t n, unsigned int seed) {
+    std::mt19937 rng(seed);
+    std::vector<int> keys(n);
+    for (auto &key : keys) {
+      key = rng() % (n * 4 + 1);
+    }
+    return keys;
+  }
+
+  template <typename C>
+  void reportDepth(std::string const&, C const&) { }
+
+  template <typename T, typename LessThan, typename Alloc, typename Summary,
+            typename Layout, typename Priority>
+  void reportDepth(std::string const &container,
+                   Treap<T, LessThan, Alloc, Summary, Layout, Priority> const &t) {
+    const TreapDepthStats stats = t.depth_stats();
+    cerr << "[depth: " << container << " " << stats.nodes << " " << stats.height << " "
+         << stats.averageDepth << " " << stats.expectedAverageDepth << "]" << endl;
+  }
+
+  /*
+   * Adapters giving the persistent containers and std::multiset the
+   * same (mutating) interface.
+   */
+  template <typename C>
+  struct PersistentAdapter {
+    C c;
+
+    PersistentAdapter() { }
+    template <typename Iter>
+    PersistentAdapter(Iter first, Iter last) : c(first, last) { }
+
+    void insert(int key) { c = c.insert(key); }
+    void erase(int key) { c = c.erase(key); }
+    typename C::iterator find(int key) const { return c.find(key); }
+    typename C::iterator lower_bound(int key) const { return c.lower_bound(key); }
+    typename C::iterator begin() const { return c.begin(); }
+    typename C::iterator end() const { return c.end(); }
+    size_t count(int key) const { return c.count(key); }
+    size_t size() const { return c.size(); }
+    // Returns a new version with 'key' inserted.
+    C derive(int key) const { return c.insert(key); }
+  };
+
+  struct MultisetAdapter {
+    std::multiset<int> c;
+
+    MultisetAdapter() { }
+    template <typename Iter>
+    MultisetAdapter(Iter first, Iter last) : c(first, last) { }
+
+    void insert(int key) { c.insert(key); }
+    void erase(int key) {
+      auto it = c.find(key);
+      if (it != c.end()) c.erase(it);
+    }
+    std::multiset<int>::const_iterator find(int key) const { return c.find(key); }
+    std::multiset<int>::const_iterator lower_bound(int key) const { return c.lower_bound(key); }
+    std::multiset<int>::const_iterator begin() const { return c.begin(); }
+    std::multiset<int>::const_iterator end() const { return c.end(); }
+    size_t count(int key) const { return c.count(key); }
+    size_t size() const { return c.size(); }
+    // A new version of a mutable container needs a full copy.
+    std::multiset<int> derive(int key) const {
+      std::multiset<int> copy(c);
+      copy.insert(key);
+      return copy;
+    }
+  };
+
+  template <typename Adapter>
+  void runCommon(Options const &opts, std::string const &name, size_t n) {
+    const std::vector<int> keys = randomKeys(n, 6271);
+    const std::vector<int> queries = randomKeys(std::min(n, maxQueries), 8271);
+    std::vector<int> sortedKeys(keys);
+    std::sort(sortedKeys.begin(), sortedKeys.end());
+
+    Adapter full(keys.begin(), keys.end());
+
+    if (enabled(opts, "insert")) {
+      Adapter a;
+      auto start = Clock::now();
+      for (auto key : keys) a.insert(key);
+      report("insert", name, n, n, Clock::now() - start);
+      reportDepth(name, a.c);
+      sink += a.size();
+    }
+
+    if (enabled(opts, "erase")) {
+      Adapter a(full);
+      std::vector<int> order(keys);
+      std::shuffle(order.begin(), order.end(), std::mt19937(1234));
+      auto start = Clock::now();
+      for (auto key : order) a.erase(key);
+      report("erase", name, n, n, Clock::now() - start);
+      sink += a.size();
+    }
+
+    if (enabled(opts, "find")) {
+      auto start = Clock::now();
+      for (auto key : queries) {
+        sink += full.find(key) != full.end();
+      }
+      report("find", name, n, queries.size(), Clock::now() - start);
+    }
+
+    if (enabled(opts, "lower_bound")) {
+      auto start = Clock::now();
+      for (auto key : queries) {
+        sink += full.lower_bound(key) != full.end();
+      }
+      report("lower_bound", name, n, queries.size(), Clock::now() - start);
+    }
+
+    if (enabled(opts, "iterate")) {
+      auto start = Clock::now();
+      for (auto it = full.begin(); it != full.end(); ++it) {
+        sink += *it;
+      }
+      report("iterate", name, n, n, Clock::now() - start);
+    }
+
+    if (enabled(opts, "count")) {
+      auto start = Clock::now();
+      for (auto key : queries) {
+        sink += full.count(key);
+      }
+      report("count", name, n, queries.size(), Clock::now() - start);
+    }
+
+    if (enabled(opts, "build_sorted")) {
+      auto start = Clock::now();
+      Adapter a(sortedKeys.begin(), sortedKeys.end());
+      report("build_sorted", name, n, n, Clock::now() - start);
+      sink += a.size();
+    }
+
+    if (enabled(opts, "build_unsorted")) {
+      auto start = Clock::now();
+      Adapter a(keys.begin(), keys.end());
+      report("build_unsorted", name, n, n, Clock::now() - start);
+      sink += a.size();
+    }
+
+    if (enabled(opts, "version_fanout")) {
+      // Derive many versions from one base and keep them all alive.
+      const size_t versions = std::max<size_t>(1, std::min<size_t>(1000, 10000000 / n));
+      std::vector<decltype(full.derive(0))> derived;
+      derived.reserve(versions);
+      auto start = Clock::now();
+      for (size_t i = 0; i < versions; ++i) {
+        derived.push_back(full.derive(queries[i % queries.size()]));
+      }
+      report("version_fanout", name, n, versions, Clock::now() - start);
+      sink += derived.size();
+    }
+  }
+
+  template <typename Adapter>
+  void runMemory(Options const &opts, std::string const &name, size_t maxSize) {
+    if (!enabled(opts, "memory")) return;
+    std::vector<std::unique_ptr<Adapter> > built;
+    built.reserve(16);
+    countHeap = true;
+    for (size_t n = opts.minSize; n <= maxSize; n *= 10) {
+      const std::vector<int> keys = randomKeys(n, 6271);
+      std::unique_ptr<Adapter> a;
+      const long long before = heapBytes.load();
+      auto start = Clock::now();
+      a.reset(new Adapter(keys.begin(), keys.end()));
+      auto elapsed = Clock::now() - start;
+      report("memory", name, n, n, elapsed,
+             static_cast<size_t>(heapBytes.load() - before - chunkBytes(a.get())));
+      built.push_back(std::move(a));
+    }
+    built.clear();
+    countHeap = false;
+  }
+
+  void runRankSelect(Options const &opts, size_t n) {
+    const std::vector<int> keys = randomKeys(n, 6271);
+    const std::vector<int> queries = randomKeys(std::min(n, maxQueries), 8271);
+    const Treap<int> t(keys.begin(), keys.end());
+    if (enabled(opts, "rank")) {
+      auto start = Clock::now();
+      for (auto key : queries) {
+        sink += t.rank(key);
+      }
+      report("rank", "Treap", n, queries.size(), Clock::now() - start);
+    }
+    if (enabled(opts, "select")) {
+      auto start = Clock::now();
+      for (auto key : queries) {
+        sink += t.select(key % n);
+      }
+      report("select", "Treap", n, queries.size(), Clock::now() - start);
+    }
+    if (enabled(opts, "percentile")) {
+      auto start = Clock::now();
+      for (auto key : queries) {
+        sink += t.percentile(key % 10001 / 100.0);
+      }
+      report("percentile", "Treap", n, queries.size(), Clock::now() - start);
+    }
+  }
+
+  void runRandomAccess(Options const &opts, size_t n) {
+    if (!enabled(opts, "random_access")) return;
+    const std::vector<int> keys = randomKeys(n, 6271);
+    Treap<int> t(keys.begin(), keys.end());
+    std::mt19937 rng(4321);
+    const size_t ops = std::min(n, maxQueries);
+    auto it = t.begin();
+    off_t pos = 0;
+    auto start = Clock::now();
+    for (size_t i = 0; i < ops; ++i) {
+      const off_t target = rng() % n;
+      it += target - pos;
+      pos = target;
+      sink += *it;
+    }
+    report("random_access", "Treap", n, ops, Clock::now() - start);
+  }
+
+  void runHintedInsert(Options const &opts, size_t n) {
+    if (!enabled(opts, "insert_hinted")) return;
+    // Nearly sorted keys: sorted, with 1% of them swapped with a
+    // neighbour a few positions away, as log timestamps would be.
+    std::vector<int> keys(randomKeys(n, 6271));
+    std::sort(keys.begin(), keys.end());
+    std::mt19937 rng(2718);
+    for (size_t i = 0; i < n / 100; ++i) {
+      const size_t pos = rng() % n;
+      std::swap(keys[pos], keys[std::min(n - 1, pos + rng() % 8)]);
+    }
+    {
+      Treap<int> t;
+      auto start = Clock::now();
+      for (auto key : keys) t = t.insert(t.end(), key);
+      report("insert_hinted", "Treap/end", n, n, Clock::now() - start);
+      sink += t.size();
+    }
+    {
+      Treap<int> t;
+      auto start = Clock::now();
+      for (auto key : keys) t = t.insert(key);
+      report("insert_hinted", "Treap/none", n, n, Clock::now() - start);
+      sink += t.size();
+    }
+    {
+      std::multiset<int> s;
+      auto start = Clock::now();
+      for (auto key : keys) s.insert(s.end(), key);
+      report("insert_hinted", "std::multiset/end", n, n, Clock::now() - start);
+      sink += s.size();
+    }
+  }
+
+  void runRangeErase(Options const &opts, size_t n) {
+    if (!enabled(opts, "erase_range")) return;
+    const std::vector<int> keys = randomKeys(n, 6271);
+    const Treap<int> t(keys.begin(), keys.end());
+    const int maxKey = static_cast<int>(n * 4);
+    // Expire 1% wide windows, as a sliding time window would.
+    const int width = std::max(1, maxKey / 100);
+    const size_t ops = std::min<size_t>(1000, n);
+    auto start = Clock::now();
+    for (size_t i = 0; i < ops; ++i) {
+      const int lo = static_cast<int>(i * 7919 % maxKey);
+      sink += t.erase_range(lo, lo + width).size();
+    }
+    report("erase_range", "Treap", n, ops, Clock::now() - start);
+  }
+
+  void runParallel(Options const &opts, size_t n) {
+    const std::vector<int> keys = randomKeys(n, 6271);
+    const Treap<int> t(keys.begin(), keys.end());
+    TreapTaskPool sequential(0);
+    TreapTaskPool &parallel = TreapTaskPool::instance();
+    TreapTaskPool *pools[] = { &sequential, &parallel };
+    const std::string names[] = {
+      "Treap/seq", "Treap/" + std::to_string(parallel.concurrency()) + "t"
+    };
+    for (int p = 0; p < 2; ++p) {
+      if (enabled(opts, "reduce")) {
+        auto start = Clock::now();
+        sink += t.transform_reduce(0L, std::plus<long>(),
+                                   [](int x) { return long(x) * 3; }, *pools[p]);
+        report("reduce", names[p], n, n, Clock::now() - start);
+      }
+      if (enabled(opts, "count_if")) {
+        auto start = Clock::now();
+        sink += t.count_if([](int x) { return x % 3 == 0; }, *pools[p]);
+        report("count_if", names[p], n, n, Clock::now() - start);
+      }
+      if (enabled(opts, "filter")) {
+        auto start = Clock::now();
+        sink += t.filter([](int x) { return x % 3 == 0; }, *pools[p]).size();
+        report("filter", names[p], n, n, Clock::now() - start);
+      }
+    }
+  }
+
+  // Total number of operations for the multi-threaded benchmarks,
+  // split evenly between the threads.
+  const size_t threadedOps = 200000;
+
+  /*
+   * A treap shared between threads through a mutex.
+   */
+  struct LockedTreap {
+    typedef Treap<int> TreapType;
+    mutable std::mutex mutex;
+    TreapType t;
+
+    explicit LockedTreap(TreapType const &initial) : t(initial) { }
+
+    TreapType load() const {
+      std::lock_guard<std::mutex> lock(mutex);
+      return t;
+    }
+    template <typename Func>
+    void update(Func fn) {
+      std::lock_guard<std::mutex> lock(mutex);
+      t = fn(t);
+    }
+  };
+
+  template <typename Shared>
+  Clock::duration runThreads(Shared &shared, size_t numThreads, size_t n,
+                             unsigned int readPercent) {
+    std::vector<std::thread> threads;
+    const size_t opsPerThread = threadedOps / numThreads;
+    auto start = Clock::now();
+    for (size_t i = 0; i < numThreads; ++i) {
+      threads.push_back(std::thread([&shared, opsPerThread, n, readPercent, i]() {
+            std::mt19937 rng(i + 1);
+            size_t found = 0;
+            for (size_t op = 0; op < opsPerThread; ++op) {
+              const int key = rng() % (n * 4 + 1);
+              if (rng() % 100 < readPercent) {
+                found += shared.load().exists(key);
+              } else {
+                shared.update([key](Treap<int> const &t) { return t.insert(key); });
+              }
+            }
+            static std::mutex sinkMutex;
+            std::lock_guard<std::mutex> lock(sinkMutex);
+            sink += found;
+          }));
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+    return Clock::now() - start;
+  }
+
+  void runAtomic(Options const &opts, size_t n) {
+    typedef AtomicTreap<int> Atomic;
+    const std::vector<int> keys = randomKeys(n, 6271);
+    const Treap<int> initial(keys.begin(), keys.end());
+    const char *benchmarks[] = { "atomic_update", "atomic_mixed" };
+    const unsigned int readPercents[] = { 0, 90 };
+    const Atomic::UpdatePolicy policies[] = { Atomic::RETRY, Atomic::BACKOFF, Atomic::COMBINE };
+    const char *policyNames[] = { "retry", "backoff", "combine" };
+
+    for (int b = 0; b < 2; ++b) {
+      if (!enabled(opts, benchmarks[b])) continue;
+      for (size_t threads = 1; threads <= opts.maxThreads; threads *= 2) {
+        const std::string suffix = "/" + std::to_string(threads) + "t";
+        const size_t ops = threadedOps / threads * threads;
+        for (int p = 0; p < 3; ++p) {
+          Atomic shared(initial, policies[p]);
+          auto elapsed = runThreads(shared, threads, n, readPercents[b]);
+          report(benchmarks[b], std::string("AtomicTreap/") + policyNames[p] + suffix,
+                 n, ops, elapsed);
+        }
+        LockedTreap locked(initial);
+        auto elapsed = runThreads(locked, threads, n, readPercents[b]);
+        report(benchmarks[b], "mutex" + suffix, n, ops, elapsed);
+      }
+    }
+  }
+
+  size_t parseSize(char const *arg) {
+    return static_cast<size_t>(atof(arg));
+  }
+
+}
+
+int main(int argc, char *argv[]) {
+  Options opts = { 1000, 1000000, 10000,
+                   std::max<size_t>(1, std::thread::hardware_concurrency()), "" };
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg.compare(0, 11, "--min-size=") == 0) {
+      opts.minSize = parseSize(argv[i] + 11);
+    } else if (arg.compare(0, 11, "--max-size=") == 0) {
+      opts.maxSize = parseSize(argv[i] + 11);
+    } else if (arg.compare(0, 16, "--mock-max-size=") == 0) {
+      opts.mockMaxSize = parseSize(argv[i] + 16);
+    } else if (arg.compare(0, 14, "--max-threads=") == 0) {
+      opts.maxThreads = std::max<size_t>(1, parseSize(argv[i] + 14));
+    } else if (arg.compare(0, 9, "--filter=") == 0) {
+      opts.filter = arg.substr(9);
+    } else {
+      cerr << "Unknown argument: " << arg << endl;
+      return 1;
+    }
+  }
+
+  typedef PersistentAdapter<Treap<int> > DefaultTreap;
+  typedef PersistentAdapter<Treap<int, std::less<int>, std::allocator<int>,
+                                  TreapNoSummary, TreapCompactLayout> > CompactTreap;
+  typedef PersistentAdapter<Treap<int, std::less<int>, TreapPoolAllocator<int>,
+                                  TreapNoSummary, TreapCompactLayout> > PooledCompactTreap;
+  typedef PersistentAdapter<Treap<int, std::less<int>, std::allocator<int>,
+                                  TreapNoSummary, TreapDefaultLayout,
+                                  TreapKeyHashPriority<int> > > KeyHashTreap;
+
+  cout << "benchmark,container,size,ops,total_ns,ns_per_op,bytes_per_element" << endl;
+  // First, before any other benchmark has used the pool.
+  runMemory<DefaultTreap>(opts, "Treap", opts.maxSize);
+  runMemory<CompactTreap>(opts, "Treap/compact", opts.maxSize);
+  runMemory<PooledCompactTreap>(opts, "Treap/compact+pool", opts.maxSize);
+  runMemory<PersistentAdapter<MockTreap<int> > >(opts, "MockTreap", opts.mockMaxSize);
+  runMemory<MultisetAdapter>(opts, "std::multiset", opts.maxSize);
+  for (size_t n = opts.minSize; n <= opts.maxSize; n *= 10) {
+    runCommon<DefaultTreap>(opts, "Treap", n);
+    runCommon<CompactTreap>(opts, "Treap/compact", n);
+    runCommon<PooledCompactTreap>(opts, "Treap/compact+pool", n);
+    runCommon<KeyHashTreap>(opts, "Treap/keyhash", n);
+    if (n <= opts.mockMaxSize) {
+      runCommon<PersistentAdapter<MockTreap<int> > >(opts, "MockTreap", n);
+    }
+    runCommon<MultisetAdapter>(opts, "std::multiset", n);
+    runRandomAccess(opts, n);
+    runRankSelect(opts, n);
+    runRangeErase(opts, n);
+    runHintedInsert(opts, n);
+    runParallel(opts, n);
+    runAtomic(opts, n);
+  }
+  cerr << "[sink: " << sink << "]" << endl;
+}
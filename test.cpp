@@ -1,7 +1,17 @@
+#define TREAP_STATS 1 // Counters are checked in test_stats()
 #include "treap.h"
 #include <iostream>
 #include <iterator>
 #include <algorithm>
+#include <array>
+#include <fstream>
+#include <map>
+#include <numeric>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <tuple>
+#include <string.h>
 #include <assert.h>
 
 using namespace std;
@@ -107,7 +117,7 @@ void test_deletion() {
 #if VERBOSE_TREAPS == 1
             t.toDot(std::cerr) << endl;
 #endif
-            auto x = std::bind(&Treap<int>::print, t);
+            auto x = std::bind(&Treap<int>::print, t, std::placeholders::_1);
             mt = mt.erase(elem);
             assert(t.size() == mt.size());
 
@@ -158,7 +168,7 @@ void test_deletion() {
         std::random_shuffle(seq.begin(), seq.end());
         for (auto &elem : seq) {
             t = t.erase(elem);
-            auto x = std::bind(&Treap<int>::print, t);
+            auto x = std::bind(&Treap<int>::print, t, std::placeholders::_1);
             mt = mt.erase(elem);
             assert(t.size() == mt.size());
             assert(std::equal(t.begin(), t.end(), mt.begin()));
@@ -231,6 +241,1305 @@ void test_iterators() {
     }
 }
 
+void test_versions() {
+    vector<int> seq(20);
+    copy_n(RNGIterator(6271), seq.size(), seq.begin());
+
+    // Every version must stay intact after later versions are
+    // derived from it, and after they are dropped.
+    vector<Treap<int> > versions(1);
+    vector<MockTreap<int> > mversions(1);
+    for (auto &elem : seq) {
+        versions.push_back(versions.back().insert(elem));
+        mversions.push_back(mversions.back().insert(elem));
+    }
+    for (auto &elem : seq) {
+        versions.push_back(versions.back().erase(elem));
+        mversions.push_back(mversions.back().erase(elem));
+    }
+    while (!versions.empty()) {
+        for (size_t i = 0; i < versions.size(); ++i) {
+            assert(versions[i].size() == mversions[i].size());
+            assert(std::equal(versions[i].begin(), versions[i].end(),
+                              mversions[i].begin()));
+        }
+        versions.erase(versions.begin() + versions.size() / 2);
+        mversions.erase(mversions.begin() + mversions.size() / 2);
+    }
+}
+
+void test_pool_allocator() {
+    typedef Treap<int, std::less<int>, TreapPoolAllocator<int> > PoolTreap;
+    vector<int> seq(1000);
+    copy_n(RNGIterator(6271), seq.size(), seq.begin());
+
+    PoolTreap t;
+    MockTreap<int> mt;
+    insert_sequence(t, seq);
+    insert_sequence(mt, seq);
+    assert(t.size() == mt.size());
+    assert(std::equal(t.begin(), t.end(), mt.begin()));
+
+    PoolTreap t2(seq.begin(), seq.end());
+    std::random_shuffle(seq.begin(), seq.end());
+    for (auto &elem : seq) {
+        t = t.erase(elem);
+        t2 = t2.insert(elem);
+    }
+    assert(t.empty());
+    assert(t2.size() == 2 * seq.size());
+
+    // Blocks cached by a thread that only frees are handed back when
+    // it exits. (A size no other test uses, so that the pool is fresh.)
+    typedef std::array<char, 72> Payload;
+    TreapPoolAllocator<Payload> alloc;
+    std::set<Payload*> freed;
+    for (int i = 0; i < 300; ++i) {
+        freed.insert(alloc.allocate(1));
+    }
+    std::thread([&]() {
+        for (auto p : freed) alloc.deallocate(p, 1);
+    }).join();
+    size_t reused = 0;
+    std::thread([&]() {
+        vector<Payload*> again;
+        for (int i = 0; i < 300; ++i) {
+            again.push_back(alloc.allocate(1));
+            reused += freed.count(again.back());
+        }
+        for (auto p : again) alloc.deallocate(p, 1);
+    }).join();
+    assert(reused == 300);
+}
+
+// Counts up to 255 elements, to test the size limit.
+struct TinyLayout {
+    typedef uint8_t size_type;
+};
+
+void test_compact_layout() {
+    typedef Treap<int, std::less<int>, std::allocator<int>, TreapNoSummary,
+                  TreapCompactLayout> CompactTreap;
+    if (sizeof(void*) == 8) {
+        assert((sizeof(TreapNode<int, std::allocator<int>, TreapNoSummary,
+                                 TreapCompactLayout>) == 32));
+        assert(sizeof(TreapNode<int>) == 40);
+    }
+
+    vector<int> seq(1000);
+    copy_n(RNGIterator(6271), seq.size(), seq.begin());
+    CompactTreap t;
+    MockTreap<int> mt;
+    insert_sequence(t, seq);
+    insert_sequence(mt, seq);
+    assert(t.size() == mt.size());
+    assert(std::equal(t.begin(), t.end(), mt.begin()));
+    assert(t.memory_usage().bytes == t.size() * 32 || sizeof(void*) != 8);
+    for (size_t i = 0; i < seq.size(); i += 3) {
+        t = t.erase(seq[i]);
+        mt = mt.erase(seq[i]);
+    }
+    assert(t.size() == mt.size());
+    assert(std::equal(t.begin(), t.end(), mt.begin()));
+    assert(*(t.begin() + 100) == *std::next(mt.begin(), 100));
+
+    // Summaries work with either layout.
+    Treap<int, std::less<int>, std::allocator<int>, TreapSumSummary<long>,
+          TreapCompactLayout> summed(seq.begin(), seq.end());
+    assert(summed.aggregate() == std::accumulate(seq.begin(), seq.end(), 0L));
+
+    // Going past what the layout can count throws, also with NDEBUG,
+    // and leaves existing versions untouched.
+    typedef Treap<int, std::less<int>, std::allocator<int>, TreapNoSummary,
+                  TinyLayout> TinyTreap;
+    vector<int> keys(255);
+    std::iota(keys.begin(), keys.end(), 0);
+    TinyTreap full(keys.begin(), keys.end());
+    assert(full.size() == 255);
+    bool threw = false;
+    try {
+        full.insert(1000);
+    } catch (std::length_error const&) {
+        threw = true;
+    }
+    assert(threw);
+    assert(full.size() == 255 && std::equal(full.begin(), full.end(), keys.begin()));
+    keys.push_back(255);
+    threw = false;
+    try {
+        TinyTreap tooMany(keys.begin(), keys.end());
+    } catch (std::length_error const&) {
+        threw = true;
+    }
+    assert(threw);
+}
+
+void test_priorities() {
+    auto saved = [](Treap<int> const &t) {
+        std::ostringstream out;
+        t.save(out);
+        return out.str();
+    };
+    // Sibling versions draw different heap keys.
+    Treap<int> base;
+    for (int i = 0; i < 20; ++i) base = base.insert(i * 2);
+    int differing = 0;
+    for (int i = 0; i < 20; ++i) {
+        differing += saved(base.insert(7)) != saved(base.insert(7));
+    }
+    assert(differing > 0);
+
+    // Random priorities balance both bulk loads and inserts.
+    vector<int> seq(1 << 14);
+    copy_n(RNGIterator(6271), seq.size(), seq.begin());
+    Treap<int> inserted;
+    insert_sequence(inserted, seq);
+    TreapDepthStats stats = inserted.depth_stats();
+    assert(stats.nodes == seq.size());
+    assert(stats.averageDepth < 1.2 * stats.expectedAverageDepth);
+    assert(stats.averageDepth > 0.8 * stats.expectedAverageDepth);
+    assert(stats.height < 4 * 14);
+    assert(stats.expectedAverageDepth > 16 && stats.expectedAverageDepth < 17);
+    TreapDepthStats loaded = Treap<int>(seq.begin(), seq.end()).depth_stats();
+    assert(loaded.height == 14 && loaded.averageDepth < 13.5);
+    assert(Treap<int>().depth_stats().nodes == 0);
+
+    // Key hashing gives the same shape however the elements arrive.
+    typedef Treap<int, std::less<int>, std::allocator<int>, TreapNoSummary,
+                  TreapDefaultLayout, TreapKeyHashPriority<int> > HashTreap;
+    auto savedHash = [](HashTreap const &t) {
+        std::ostringstream out;
+        t.save(out);
+        return out.str();
+    };
+    vector<int> keys(2000);
+    std::iota(keys.begin(), keys.end(), 0);
+    HashTreap bulk(keys.begin(), keys.end());
+    std::random_shuffle(keys.begin(), keys.end());
+    HashTreap inOrder;
+    insert_sequence(inOrder, keys);
+    assert(savedHash(bulk) == savedHash(inOrder));
+    HashTreap batched = HashTreap().insert_batch(keys.begin(), keys.end());
+    assert(savedHash(batched) == savedHash(bulk));
+    // Erase joins the children by priority, so it keeps the shape too.
+    assert(savedHash(bulk.erase(5).insert(5)) == savedHash(bulk));
+    HashTreap odd = bulk;
+    for (int k = 0; k < 2000; k += 2) odd = odd.erase(k);
+    vector<int> odds;
+    for (int k = 1; k < 2000; k += 2) odds.push_back(k);
+    assert(savedHash(odd) == savedHash(HashTreap(odds.begin(), odds.end())));
+    HashTreap::value_type sum = 0;
+    for (auto x : inOrder) sum += x;
+    assert(sum == 1999 * 1000);
+    TreapDepthStats hashed = inOrder.depth_stats();
+    assert(hashed.averageDepth < 1.3 * hashed.expectedAverageDepth);
+}
+
+void test_transient() {
+    vector<int> seq(500);
+    copy_n(RNGIterator(6271), seq.size(), seq.begin());
+    std::transform(seq.begin(), seq.end(), seq.begin(),
+                   [](int x) { return x % 200; });
+
+    Treap<int> base(seq.begin(), seq.begin() + 100);
+    MockTreap<int> mbase(seq.begin(), seq.begin() + 100);
+    vector<int> before(base.begin(), base.end());
+
+    auto tt = base.transient();
+    MockTreap<int> mt = mbase;
+    for (size_t i = 100; i < seq.size(); ++i) {
+        tt.insert(seq[i]);
+        mt = mt.insert(seq[i]);
+        if (i % 3 == 0) {
+            tt.erase(seq[i / 2]);
+            mt = mt.erase(seq[i / 2]);
+        }
+        assert(tt.size() == mt.size());
+    }
+    Treap<int> t = tt.persistent();
+    assert(t.size() == mt.size());
+    assert(std::equal(t.begin(), t.end(), mt.begin()));
+
+    // Mutating the builder after persistent() must not affect 't'.
+    for (auto &elem : seq) {
+        tt.erase(elem);
+    }
+    assert(tt.empty());
+    assert(std::equal(t.begin(), t.end(), mt.begin()));
+
+    // The version the builder was created from is unchanged.
+    assert(base.size() == before.size());
+    assert(std::equal(base.begin(), base.end(), before.begin()));
+}
+
+void test_parallel_algorithms() {
+    vector<int> seq(100000);
+    copy_n(RNGIterator(6271), seq.size(), seq.begin());
+    std::transform(seq.begin(), seq.end(), seq.begin(),
+                   [](int x) { return x % 50000; });
+    Treap<int> t(seq.begin(), seq.end());
+    vector<int> sorted(seq);
+    std::sort(sorted.begin(), sorted.end());
+
+    TreapTaskPool pool(3), sequential(0);
+    TreapTaskPool *pools[] = { &pool, &sequential };
+    for (TreapTaskPool *p : pools) {
+        std::atomic<long> total(0);
+        t.parallel_for_each([&total](int x) { total += x; }, *p);
+        const long expectedSum = std::accumulate(sorted.begin(), sorted.end(), 0L);
+        assert(total == expectedSum);
+        assert(t.reduce(0L, std::plus<long>(), *p) == expectedSum);
+        assert(t.transform_reduce(5L, std::plus<long>(),
+                                  [](int x) { return long(x) * x; }, *p) ==
+               std::accumulate(sorted.begin(), sorted.end(), 5L,
+                               [](long acc, int x) { return acc + long(x) * x; }));
+
+        // Elements are combined in sorted order: (first, last, sorted).
+        typedef std::tuple<int, int, bool> Run;
+        Run run = t.transform_reduce(Run(sorted[0], sorted[0], true),
+                                     [](Run const &a, Run const &b) {
+                                         return Run(std::get<0>(a), std::get<1>(b),
+                                                    std::get<2>(a) && std::get<2>(b) &&
+                                                    std::get<1>(a) <= std::get<0>(b));
+                                     },
+                                     [](int x) { return Run(x, x, true); }, *p);
+        assert(std::get<0>(run) == sorted.front());
+        assert(std::get<1>(run) == sorted.back());
+        assert(std::get<2>(run));
+
+        auto even = [](int x) { return x % 2 == 0; };
+        assert(t.count_if(even, *p) ==
+               size_t(std::count_if(sorted.begin(), sorted.end(), even)));
+        Treap<int> evens = t.filter(even, *p);
+        vector<int> expected;
+        std::copy_if(sorted.begin(), sorted.end(), std::back_inserter(expected), even);
+        assert(evens.size() == expected.size());
+        assert(std::equal(evens.begin(), evens.end(), expected.begin()));
+        assert(evens.depth_stats().height < 60);
+
+        // Keeping everything shares every node.
+        Treap<int> all = t.filter([](int) { return true; }, *p);
+        assert(all.memory_usage(t).exclusive.nodes == 0);
+        assert(t.filter([](int) { return false; }, *p).empty());
+        assert(Treap<int>().reduce(7, std::plus<int>(), *p) == 7);
+    }
+
+    // Exceptions thrown by the callbacks reach the caller.
+    bool thrown = false;
+    try {
+        t.parallel_for_each([](int x) { if (x == 49999) throw std::runtime_error("x"); }, pool);
+    } catch (std::runtime_error const&) {
+        thrown = true;
+    }
+    assert(thrown == (std::count(sorted.begin(), sorted.end(), 49999) > 0));
+
+    // print() uses the sequential (non recursive) traversal.
+    std::ostringstream printed, expectedPrint;
+    t.print(printed);
+    for (int x : sorted) expectedPrint << x << ", ";
+    assert(printed.str() == expectedPrint.str());
+}
+
+void test_range_erase() {
+    vector<int> seq(20000);
+    copy_n(RNGIterator(6271), seq.size(), seq.begin());
+    std::transform(seq.begin(), seq.end(), seq.begin(),
+                   [](int x) { return x % 5000; });
+    Treap<int> t(seq.begin(), seq.end());
+    multiset<int> ms(seq.begin(), seq.end());
+
+    const int bounds[][2] = { { 100, 200 }, { -5, 10 }, { 4990, 6000 }, { 300, 300 },
+                              { 400, 350 }, { -10, 10000 }, { 2500, 2501 } };
+    for (auto const &b : bounds) {
+        const int lo = b[0], hi = b[1];
+        multiset<int> remaining(ms), removed;
+        if (lo < hi) {
+            removed.insert(ms.lower_bound(lo), ms.lower_bound(hi));
+            remaining.erase(remaining.lower_bound(lo), remaining.lower_bound(hi));
+        }
+        Treap<int> erased = t.erase_range(lo, hi);
+        assert(erased.size() == remaining.size());
+        assert(std::equal(erased.begin(), erased.end(), remaining.begin()));
+        auto parts = t.extract_range(lo, hi);
+        assert(parts.first.size() == remaining.size());
+        assert(std::equal(parts.first.begin(), parts.first.end(), remaining.begin()));
+        assert(parts.second.size() == removed.size());
+        assert(std::equal(parts.second.begin(), parts.second.end(), removed.begin()));
+    }
+    // The original is unchanged.
+    assert(t.size() == ms.size());
+    assert(std::equal(t.begin(), t.end(), ms.begin()));
+
+    // By iterator ranges (here by rank).
+    vector<int> sorted(ms.begin(), ms.end());
+    const size_t ranks[][2] = { { 0, 0 }, { 0, 1 }, { 10, 5000 }, { 19000, 20000 }, { 0, 20000 } };
+    for (auto const &r : ranks) {
+        Treap<int> erased = t.erase(t.begin() + r[0], t.begin() + r[1]);
+        vector<int> expected(sorted);
+        expected.erase(expected.begin() + r[0], expected.begin() + r[1]);
+        assert(erased.size() == expected.size());
+        assert(std::equal(erased.begin(), erased.end(), expected.begin()));
+    }
+
+    // Only the boundaries of the range are copied.
+    TreapStats &stats = TreapStats::local();
+    stats.reset();
+    Treap<int> window = t.erase_range(1000, 3000);
+    assert(stats.operations[TreapStats::ERASE].calls == 1);
+    assert(stats.operations[TreapStats::ERASE].nodesAllocated < 200);
+    assert(window.memory_usage(t).exclusive.nodes < 200);
+}
+
+void test_rank_select() {
+    vector<int> seq(5000);
+    copy_n(RNGIterator(6271), seq.size(), seq.begin());
+    std::transform(seq.begin(), seq.end(), seq.begin(),
+                   [](int x) { return x % 2000; });
+    Treap<int> t(seq.begin(), seq.end());
+    vector<int> sorted(seq);
+    std::sort(sorted.begin(), sorted.end());
+
+    TreapStats &stats = TreapStats::local();
+    stats.reset();
+    for (int key = -3; key < 2005; key += 3) {
+        const size_t lower = std::lower_bound(sorted.begin(), sorted.end(), key) - sorted.begin();
+        const size_t upper = std::upper_bound(sorted.begin(), sorted.end(), key) - sorted.begin();
+        assert(t.rank(key) == lower);
+        assert(t.count(key) == upper - lower);
+        for (int width = 0; width < 300; width += 37) {
+            const size_t end = std::lower_bound(sorted.begin(), sorted.end(), key + width) -
+                sorted.begin();
+            assert(t.count_range(key, key + width) == end - lower);
+        }
+        assert(t.count_range(key, key - 10) == 0);
+    }
+    for (size_t k = 0; k < sorted.size(); k += 7) {
+        assert(t.select(k) == sorted[k]);
+    }
+    assert(t.select(sorted.size() - 1) == sorted.back());
+    assert(stats.operations[TreapStats::LOOKUP].nodesAllocated == 0);
+
+    assert(t.percentile(0) == sorted.front());
+    assert(t.percentile(100) == sorted.back());
+    assert(t.percentile(50) == sorted[sorted.size() / 2 - 1]);
+    assert(t.percentile(99.9) == sorted[4994]);
+    assert(Treap<int>().count_range(0, 10) == 0);
+    assert(Treap<int>().rank(5) == 0);
+    Treap<int> single = Treap<int>().insert(42);
+    assert(single.percentile(1) == 42 && single.select(0) == 42);
+
+    // Out of range queries throw, also with NDEBUG.
+    int thrown = 0;
+    try { single.select(1); } catch (std::out_of_range const&) { ++thrown; }
+    try { Treap<int>().select(0); } catch (std::out_of_range const&) { ++thrown; }
+    try { Treap<int>().percentile(50); } catch (std::out_of_range const&) { ++thrown; }
+    try { single.percentile(100.5); } catch (std::out_of_range const&) { ++thrown; }
+    try { single.percentile(std::nan("")); } catch (std::out_of_range const&) { ++thrown; }
+    assert(thrown == 5);
+}
+
+struct FirstLess {
+    bool operator()(pair<int, int> const &lhs, pair<int, int> const &rhs) const {
+        return lhs.first < rhs.first;
+    }
+};
+
+void test_hinted_insert() {
+    multiset<int> expected;
+    Treap<int> t;
+    vector<int> seq(3000);
+    copy_n(RNGIterator(4099), seq.size(), seq.begin());
+    for (size_t i = 0; i < seq.size(); ++i) {
+        const int x = seq[i] % 500;
+        switch (i % 4) {
+        case 0: t = t.insert(t.end(), x); break;
+        case 1: t = t.insert(t.begin(), x); break;
+        case 2: t = t.insert(t.lower_bound(x), x); break;
+        default: {
+            // An arbitrary, possibly far away hint.
+            Treap<int>::iterator hint = t.begin();
+            if (!t.empty()) hint += seq[(i * 7) % seq.size()] % t.size();
+            t = t.insert(hint, x);
+        }
+        }
+        expected.insert(x);
+    }
+    assert(t.size() == expected.size());
+    assert(std::equal(t.begin(), t.end(), expected.begin()));
+    assert(Treap<int>().insert(Treap<int>().end(), 3).size() == 1);
+
+    // Equivalent elements go where std::multiset puts them: right
+    // before the hint if equivalent to *hint, and otherwise at the
+    // end of their run closest to the hint. The second member tells
+    // them apart.
+    typedef pair<int, int> Elem;
+    typedef Treap<Elem, FirstLess> PairTreap;
+    PairTreap base;
+    multiset<Elem, FirstLess> baseExpected;
+    for (int i = 0; i < 40; ++i) {
+        base = base.insert(Elem(i % 5, i));
+        baseExpected.insert(Elem(i % 5, i));
+    }
+    for (size_t i = 0; i <= base.size(); ++i) {
+        for (int key = -1; key <= 5; ++key) {
+            PairTreap hinted = base.insert(base.begin() + i, Elem(key, 100));
+            multiset<Elem, FirstLess> expected(baseExpected);
+            auto hint = expected.begin();
+            std::advance(hint, i);
+            expected.insert(hint, Elem(key, 100));
+            assert(hinted.size() == expected.size());
+            assert(std::equal(hinted.begin(), hinted.end(), expected.begin()));
+        }
+    }
+
+    // Appending at end() only compares against the last element.
+    Treap<int> appended, plain;
+    TreapStats &stats = TreapStats::local();
+    stats.reset();
+    for (int i = 0; i < 2000; ++i) appended = appended.insert(appended.end(), i);
+    const size_t hintedComparisons = stats.operations[TreapStats::INSERT].comparisons;
+    stats.reset();
+    for (int i = 0; i < 2000; ++i) plain = plain.insert(i);
+    const size_t plainComparisons = stats.operations[TreapStats::INSERT].comparisons;
+    assert(hintedComparisons <= 2000);
+    assert(hintedComparisons * 4 < plainComparisons);
+    assert(std::equal(appended.begin(), appended.end(), plain.begin()));
+}
+
+void test_split_join() {
+    vector<int> seq(200);
+    copy_n(RNGIterator(6271), seq.size(), seq.begin());
+    std::transform(seq.begin(), seq.end(), seq.begin(),
+                   [](int x) { return x % 100; });
+    Treap<int> t;
+    insert_sequence(t, seq);
+    vector<int> sorted(t.begin(), t.end());
+
+    for (int key = -1; key <= 101; key += 7) {
+        auto parts = t.split(key);
+        auto mid = std::lower_bound(sorted.begin(), sorted.end(), key);
+        assert(parts.first.size() == size_t(mid - sorted.begin()));
+        assert(std::equal(parts.first.begin(), parts.first.end(), sorted.begin()));
+        assert(std::equal(parts.second.begin(), parts.second.end(), mid));
+
+        auto joined = Treap<int>::join(parts.first, parts.second);
+        assert(joined.size() == t.size());
+        assert(std::equal(joined.begin(), joined.end(), sorted.begin()));
+    }
+
+    for (size_t rank = 0; rank <= t.size(); rank += 13) {
+        auto parts = t.split_at(rank);
+        assert(parts.first.size() == rank);
+        assert(std::equal(parts.first.begin(), parts.first.end(), sorted.begin()));
+        assert(std::equal(parts.second.begin(), parts.second.end(),
+                          sorted.begin() + rank));
+        // The parts remain usable as regular treaps.
+        auto t2 = parts.second.insert(-5).erase(sorted.back());
+        assert(t2.size() == parts.second.size());
+        assert(*t2.begin() == -5);
+    }
+
+    // The original is untouched.
+    assert(std::equal(t.begin(), t.end(), sorted.begin()));
+}
+
+void test_set_operations() {
+    typedef pair<int, int> Elem;
+    typedef Treap<Elem, FirstLess> PairTreap;
+    TreapTaskPool pool(3);
+
+    for (size_t n : { 0, 1, 50, 20000 }) {
+        // The second member records where each element came from, so
+        // that we can check which of several equal elements were
+        // picked.
+        vector<Elem> lhs, rhs;
+        RNGIterator rng(6271);
+        for (size_t i = 0; i < n; ++i, ++rng) {
+            lhs.emplace_back(*rng % (n + 1), 1);
+        }
+        for (size_t i = 0; i < n / 3; ++i, ++rng) {
+            rhs.emplace_back(*rng % (n + 1), 2);
+        }
+        std::stable_sort(lhs.begin(), lhs.end(), FirstLess());
+        std::stable_sort(rhs.begin(), rhs.end(), FirstLess());
+        PairTreap tl, tr;
+        insert_sequence(tl, lhs);
+        insert_sequence(tr, rhs);
+
+        vector<Elem> expected;
+        std::set_union(lhs.begin(), lhs.end(), rhs.begin(), rhs.end(),
+                       std::back_inserter(expected), FirstLess());
+        for (auto *p : { &pool, &TreapTaskPool::instance() }) {
+            auto result = tl.set_union(tr, *p);
+            assert(result.size() == expected.size());
+            assert(std::equal(result.begin(), result.end(), expected.begin()));
+        }
+
+        expected.clear();
+        std::set_intersection(lhs.begin(), lhs.end(), rhs.begin(), rhs.end(),
+                              std::back_inserter(expected), FirstLess());
+        auto intersection = tl.set_intersection(tr, pool);
+        assert(intersection.size() == expected.size());
+        assert(std::equal(intersection.begin(), intersection.end(), expected.begin()));
+
+        expected.clear();
+        std::set_difference(rhs.begin(), rhs.end(), lhs.begin(), lhs.end(),
+                            std::back_inserter(expected), FirstLess());
+        auto difference = tr.set_difference(tl, pool);
+        assert(difference.size() == expected.size());
+        assert(std::equal(difference.begin(), difference.end(), expected.begin()));
+
+        // Operands are unchanged.
+        assert(std::equal(tl.begin(), tl.end(), lhs.begin()));
+        assert(std::equal(tr.begin(), tr.end(), rhs.begin()));
+    }
+}
+
+void test_bulk_load() {
+    typedef pair<int, int> Elem;
+    TreapTaskPool pool(3);
+
+    for (size_t n : { 1, 2, 100, 50000 }) {
+        vector<Elem> seq;
+        RNGIterator rng(6271);
+        for (size_t i = 0; i < n; ++i, ++rng) {
+            seq.emplace_back(*rng % (n / 2 + 1), i);
+        }
+        Treap<Elem, FirstLess> t(seq.begin(), seq.end(), pool);
+        Treap<Elem, FirstLess> t2;
+        insert_sequence(t2, seq);
+
+        std::stable_sort(seq.begin(), seq.end(), FirstLess());
+        assert(t.size() == seq.size());
+        assert(std::equal(t.begin(), t.end(), seq.begin()));
+        assert(std::equal(t2.begin(), t2.end(), seq.begin()));
+
+        Treap<Elem, FirstLess> t3(seq.data(), seq.data() + seq.size());
+        assert(std::equal(t3.begin(), t3.end(), seq.begin()));
+    }
+}
+
+void test_batch() {
+    typedef pair<int, int> Elem;
+    vector<Elem> seq;
+    RNGIterator rng(6271);
+    for (int i = 0; i < 2000; ++i, ++rng) {
+        seq.emplace_back(*rng % 500, i);
+    }
+    Treap<Elem, FirstLess> t;
+    MockTreap<Elem, FirstLess> mt;
+    for (size_t i = 0; i < seq.size(); i += 250) {
+        vector<Elem> batch(seq.begin() + i, seq.begin() + i + 250);
+        auto prev = t;
+        t = t.insert_batch(batch.begin(), batch.end());
+        insert_sequence(mt, batch);
+        assert(t.size() == mt.size());
+        assert(std::equal(t.begin(), t.end(), mt.begin()));
+        assert(prev.size() == i);
+    }
+
+    for (size_t i = 0; i < seq.size(); i += 300) {
+        // Includes keys that aren't present, and repeated keys.
+        vector<Elem> batch;
+        for (size_t j = 0; j < 300; ++j) {
+            batch.emplace_back(seq[(i + j * 7) % seq.size()].first % 600, -1);
+        }
+        auto prev = t;
+        t = t.erase_batch(batch.begin(), batch.end());
+        for (auto &elem : batch) {
+            mt = mt.erase(elem);
+        }
+        assert(t.size() == mt.size());
+        assert(std::equal(t.begin(), t.end(), mt.begin()));
+        assert(prev.size() != t.size());
+    }
+}
+
+void test_iterator_equality() {
+    vector<int> seq = { 73, 23, 43, 83, 13, 3, 23, 23, 43, 33, 63, 33, 93, 3 };
+    Treap<int> t(seq.begin(), seq.end());
+    std::sort(seq.begin(), seq.end());
+
+    // Iterators reaching the same element in different ways compare
+    // equal.
+    auto it = t.begin();
+    for (size_t i = 0; i < seq.size(); ++i) {
+        assert(it == t.begin() + i);
+        assert(t.lower_bound(seq[i]) == t.begin() + (std::lower_bound(seq.begin(), seq.end(), seq[i]) - seq.begin()));
+        auto prev = it++;
+        assert(prev != it);
+        assert(*prev == seq[i]);
+    }
+    assert(it == t.end());
+    assert(t.find(1000) == t.end());
+    assert(t.find(-1) == t.end());
+    assert(t.find(43) == t.lower_bound(43));
+    assert(t.upper_bound(93) == t.end());
+
+    // Iterators of different versions never compare equal.
+    auto t2 = t.insert(1000);
+    assert(t2.begin() != t.begin());
+    assert(t2.end() != t.end());
+}
+
+void test_stats() {
+    TreapStats &stats = TreapStats::local();
+    const TreapOperationStats &inserts = stats.operations[TreapStats::INSERT];
+    const TreapOperationStats &lookups = stats.operations[TreapStats::LOOKUP];
+    const TreapOperationStats &erases = stats.operations[TreapStats::ERASE];
+
+    stats.reset();
+    Treap<int> t;
+    for (int i = 0; i < 100; ++i) {
+        t = t.insert(i);
+    }
+    assert(inserts.calls == 100);
+    assert(inserts.nodesAllocated >= 100);
+    assert(inserts.nodesAllocated == 100 + inserts.clones);
+    assert(inserts.bytesAllocated > 0);
+    assert(inserts.comparisons > 0);
+    // Inserts split the subtree below the insertion point instead
+    // of rotating the new node up.
+    assert(inserts.rotations == 0);
+    assert(inserts.clones < 100 * 20);
+    assert(inserts.pathNodes > 0);
+
+    // Lookups don't allocate.
+    assert(t.exists(42));
+    t.find(43);
+    assert(lookups.calls == 2);
+    assert(lookups.nodesAllocated == 0);
+    assert(lookups.pathNodes > 0);
+
+    // Nodes no longer referenced by any version are freed.
+    const size_t freedBefore = stats.total().nodesFreed;
+    t = t.erase(50);
+    assert(erases.calls == 1);
+    assert(stats.total().nodesFreed > freedBefore);
+    // Erasing copies the ancestors and the seam of the join only, and
+    // erasing a missing key copies nothing.
+    assert(erases.nodesAllocated == erases.clones);
+    assert(erases.clones < 40);
+    const size_t clonesBefore = erases.clones;
+    assert(t.erase(50).size() == t.size());
+    assert(erases.clones == clonesBefore);
+
+    t = Treap<int>();
+    TreapOperationStats total = stats.total();
+    assert(total.nodesAllocated == total.nodesFreed);
+    assert(total.bytesAllocated == total.bytesFreed);
+
+    stats.reset();
+    assert(stats.total().calls == 0);
+}
+
+void test_memory_report() {
+    typedef Treap<int> T;
+    vector<int> seq;
+    for (int i = 0; i < 1000; ++i) {
+        seq.push_back((i * 7919) % 1000);
+    }
+    T base(seq.begin(), seq.end());
+    assert(base.memory_usage().nodes == 1000);
+    assert(base.reclaimable_memory().nodes == 1000);
+    assert(base.reclaimable_memory().bytes == base.memory_usage().bytes);
+
+    // A copy of the same version pins every node.
+    T copy(base);
+    assert(base.reclaimable_memory().nodes == 0);
+    copy = T();
+
+    vector<T> versions;
+    versions.push_back(base);
+    versions.push_back(base.insert(5000));
+    versions.push_back(base.erase(500));
+    versions.push_back(T(seq.begin(), seq.begin() + 10));
+    versions.push_back(T());
+    auto report = T::memory_report(versions.begin(), versions.end());
+    assert(report.size() == versions.size());
+    for (size_t i = 0; i < versions.size(); ++i) {
+        assert(report[i].total.nodes == versions[i].size());
+        assert(report[i].shared.nodes + report[i].exclusive.nodes == report[i].total.nodes);
+        assert(report[i].shared.bytes + report[i].exclusive.bytes == report[i].total.bytes);
+    }
+    // Derived versions only own their copied paths.
+    assert(report[1].exclusive.nodes > 0 && report[1].exclusive.nodes < 100);
+    assert(report[2].exclusive.nodes < 100);
+    // ... and so does the base version, whose other nodes are shared.
+    assert(report[0].exclusive.nodes < 100 && report[0].shared.nodes > 900);
+    // Unrelated versions share nothing.
+    assert(report[3].exclusive.nodes == 10);
+    assert(report[4].total.nodes == 0);
+
+    // Exclusive nodes are the ones dropping a version frees.
+    auto pair = versions[1].memory_usage(base);
+    assert(pair.exclusive.nodes == report[1].exclusive.nodes);
+    versions.clear();
+    T derived = base.insert(5000);
+    assert(derived.memory_usage(base).exclusive.nodes ==
+           derived.reclaimable_memory().nodes);
+    base = T();
+    assert(derived.reclaimable_memory().nodes == derived.size());
+}
+
+// Sum of the second members, in a treap ordered by the first.
+struct SecondSum {
+    typedef long value_type;
+    static long identity() { return 0; }
+    static long lift(pair<int, int> const &elem) { return elem.second; }
+    static long combine(long lhs, long rhs) { return lhs + rhs; }
+};
+
+// Concatenation of the elements, to check that the order of
+// combination is preserved.
+struct Concat {
+    typedef string value_type;
+    static string identity() { return ""; }
+    static string lift(int elem) { return to_string(elem) + ","; }
+    static string combine(string const &lhs, string const &rhs) { return lhs + rhs; }
+};
+
+template <typename Tr>
+void check_aggregates(Tr const &t, vector<int> const &expected) {
+    assert(t.size() == expected.size());
+    assert(t.aggregate() == std::accumulate(expected.begin(), expected.end(), 0L));
+    for (size_t i = 0; i <= expected.size(); i += 1 + expected.size() / 13) {
+        for (size_t j = i; j <= expected.size(); j += 1 + expected.size() / 11) {
+            assert(t.aggregate(t.begin() + i, t.begin() + j) ==
+                   std::accumulate(expected.begin() + i, expected.begin() + j, 0L));
+        }
+    }
+}
+
+void test_aggregate() {
+    typedef Treap<int, std::less<int>, std::allocator<int>, TreapSumSummary<long> > SumTreap;
+    vector<int> seq;
+    SumTreap t;
+    for (int i = 0; i < 500; ++i) {
+        const int x = (i * 7919) % 1000;
+        seq.push_back(x);
+        t = t.insert(x);
+    }
+    vector<int> sorted(seq);
+    std::sort(sorted.begin(), sorted.end());
+    check_aggregates(t, sorted);
+    check_aggregates(SumTreap(seq.begin(), seq.end()), sorted);
+    check_aggregates(SumTreap(sorted.begin(), sorted.end()), sorted);
+
+    // Erase
+    vector<int> rest(sorted);
+    SumTreap t2(t);
+    for (size_t i = 0; i < seq.size(); i += 3) {
+        t2 = t2.erase(seq[i]);
+        rest.erase(std::lower_bound(rest.begin(), rest.end(), seq[i]));
+    }
+    check_aggregates(t2, rest);
+    check_aggregates(t, sorted);
+    t2 = t2.erase(t2.begin() + 10);
+    rest.erase(rest.begin() + 10);
+    check_aggregates(t2, rest);
+
+    // Split, join, set operations and batches
+    auto parts = t.split(500);
+    check_aggregates(parts.first, vector<int>(sorted.begin(), std::lower_bound(sorted.begin(), sorted.end(), 500)));
+    check_aggregates(SumTreap::join(parts.first, parts.second), sorted);
+    vector<int> diff;
+    std::set_difference(sorted.begin(), sorted.end(), rest.begin(), rest.end(), back_inserter(diff));
+    check_aggregates(t.set_difference(t2), diff);
+    check_aggregates(t.erase_batch(diff.begin(), diff.end()), rest);
+    check_aggregates(t2.insert_batch(diff.begin(), diff.end()), sorted);
+
+    // Transient updates
+    auto tr = t.transient();
+    vector<int> expected(sorted);
+    for (size_t i = 0; i < seq.size(); i += 3) {
+        tr.erase(seq[i]);
+        expected.erase(std::lower_bound(expected.begin(), expected.end(), seq[i]));
+    }
+    tr.insert(5).insert(5000);
+    expected.insert(std::lower_bound(expected.begin(), expected.end(), 5), 5);
+    expected.push_back(5000);
+    check_aggregates(tr.persistent(), expected);
+    check_aggregates(t, sorted);
+
+    // update() changes the summary of an element that compares
+    // equal.
+    typedef pair<int, int> Elem;
+    Treap<Elem, FirstLess, std::allocator<Elem>, SecondSum> pt;
+    for (int i = 0; i < 100; ++i) {
+        pt = pt.insert(Elem(i, 1));
+    }
+    assert(pt.aggregate() == 100);
+    auto pt2 = pt.update(Elem(42, 0), Elem(42, 10));
+    assert(pt2.aggregate() == 109);
+    assert(pt2.aggregate(pt2.lower_bound(Elem(40, 0)), pt2.lower_bound(Elem(50, 0))) == 19);
+    assert(pt.aggregate() == 100);
+    auto pt3 = pt2.transient().update(Elem(7, 0), Elem(7, 3)).persistent();
+    assert(pt3.aggregate() == 111);
+
+    // Elements are combined in sorted order.
+    Treap<int, std::less<int>, std::allocator<int>, Concat> ct;
+    for (int x : { 3, 1, 4, 1, 5, 9, 2, 6 }) {
+        ct = ct.insert(x);
+    }
+    assert(ct.aggregate() == "1,1,2,3,4,5,6,9,");
+    assert(ct.aggregate(ct.begin() + 2, ct.begin() + 5) == "2,3,4,");
+    assert(ct.aggregate(ct.end(), ct.end()) == "");
+
+    Treap<int, std::less<int>, std::allocator<int>, TreapMinSummary<int> > mt(seq.begin(), seq.end());
+    assert(mt.aggregate() == sorted.front());
+    assert(mt.aggregate(mt.begin() + 100, mt.end()) == sorted[100]);
+    assert(Treap<int>().size() == 0);
+}
+
+// Compares std::string and C strings without converting.
+struct StringLess {
+    typedef void is_transparent;
+    static int compare(string const &lhs, string const &rhs) { return lhs.compare(rhs); }
+    static int compare(string const &lhs, char const *rhs) { return lhs.compare(rhs); }
+    static int compare(char const *lhs, string const &rhs) { return -rhs.compare(lhs); }
+    template <typename A, typename B>
+    bool operator()(A const &lhs, B const &rhs) const { return compare(lhs, rhs) < 0; }
+};
+
+template <typename M>
+void check_map(PersistentMap<int, int> const &m, M const &expected) {
+    assert(m.size() == expected.size());
+    vector<pair<int, int> > entries(expected.begin(), expected.end());
+    assert(std::equal(m.begin(), m.end(), entries.begin()));
+    for (auto &entry : expected) {
+        assert(m.contains(entry.first));
+        assert(m.at(entry.first) == entry.second);
+        assert(*m.get(entry.first) == entry.second);
+    }
+}
+
+void test_persistent_map() {
+    typedef PersistentMap<int, int> Map;
+    Map m;
+    map<int, int> expected;
+    vector<Map> versions;
+    vector<map<int, int> > expectedVersions;
+    for (int i = 0; i < 2000; ++i) {
+        const int key = (i * 7919) % 300;
+        switch (i % 4) {
+        case 0:
+        case 1:
+            m = m.upsert(key, i);
+            expected[key] = i;
+            break;
+        case 2:
+            m = m.assign(key, -i);
+            if (expected.count(key)) expected[key] = -i;
+            break;
+        case 3:
+            m = m.erase(key);
+            expected.erase(key);
+            break;
+        }
+        if (i % 100 == 0) {
+            versions.push_back(m);
+            expectedVersions.push_back(expected);
+        }
+    }
+    check_map(m, expected);
+    for (size_t i = 0; i < versions.size(); ++i) {
+        check_map(versions[i], expectedVersions[i]);
+    }
+
+    assert(m.get(1000) == nullptr);
+    assert(!m.contains(-1));
+    bool thrown = false;
+    try {
+        m.at(1000);
+    } catch (std::out_of_range const&) {
+        thrown = true;
+    }
+    assert(thrown);
+    assert(m.erase(1000).size() == m.size());
+    assert(m.assign(1000, 1).get(1000) == nullptr);
+
+    // Heterogeneous lookup
+    PersistentMap<string, int, StringLess> sm;
+    sm = sm.upsert("one", 1).upsert("two", 2).upsert("three", 3);
+    sm = sm.upsert("two", 22);
+    assert(sm.size() == 3);
+    assert(sm.at("two") == 22);
+    assert(*sm.get(string("three")) == 3);
+    char key[] = "one";
+    assert(sm.contains(static_cast<char const*>(key)));
+    assert(sm.get("four") == nullptr);
+    assert(sm.erase("one").size() == 2);
+}
+
+void test_atomic_treap() {
+    typedef AtomicTreap<int> Atomic;
+    typedef Atomic::TreapType T;
+
+    // More loads than are prepaid for one published version.
+    {
+        Atomic a(T().insert(1));
+        for (int i = 0; i < 100000; ++i) {
+            assert(a.load().size() == 1);
+        }
+        vector<T> held;
+        for (int i = 0; i < 40000; ++i) {
+            held.push_back(a.load());
+        }
+        a.store(a.load().insert(2));
+        assert(a.load().size() == 2);
+        assert(held.back().size() == 1);
+    }
+
+    // Concurrent loads well past the prepaid references, with every
+    // load from the second half on replenishing them.
+    {
+        Atomic a(T().insert(1));
+        vector<std::thread> readers;
+        for (int r = 0; r < 4; ++r) {
+            readers.push_back(std::thread([&a]() {
+                vector<T> held;
+                for (int i = 0; i < 30000; ++i) {
+                    held.push_back(a.load());
+                    if (held.size() == 1000) held.clear();
+                }
+            }));
+        }
+        for (auto &reader : readers) {
+            reader.join();
+        }
+        a.store(T());
+        assert(a.load().empty());
+    }
+
+    // compare_exchange only succeeds on the same version.
+    {
+        Atomic a;
+        T expected = a.load();
+        T one = expected.insert(1);
+        assert(a.compare_exchange(expected, one));
+        T stale = T().insert(1);
+        assert(!a.compare_exchange(stale, T()));
+        assert(stale.size() == 1 && *stale.begin() == 1);
+        assert(a.load().exists(1));
+    }
+
+    const Atomic::UpdatePolicy policies[] = { Atomic::RETRY, Atomic::BACKOFF, Atomic::COMBINE };
+    for (auto policy : policies) {
+        Atomic a(T(), policy);
+        const int numThreads = 4;
+        const int perThread = 500;
+        std::atomic<bool> writing(true);
+        std::thread reader([&]() {
+            size_t lastSize = 0;
+            while (writing.load()) {
+                T t = a.load();
+                assert(t.size() >= lastSize);
+                lastSize = t.size();
+                assert(std::is_sorted(t.begin(), t.end()));
+            }
+        });
+        vector<std::thread> writers;
+        for (int w = 0; w < numThreads; ++w) {
+            writers.push_back(std::thread([&a, w]() {
+                for (int i = 0; i < perThread; ++i) {
+                    const int key = i * numThreads + w;
+                    T updated = a.update([key](T const &t) { return t.insert(key); });
+                    assert(updated.exists(key));
+                }
+            }));
+        }
+        for (auto &writer : writers) {
+            writer.join();
+        }
+        writing = false;
+        reader.join();
+        T result = a.load();
+        assert(result.size() == size_t(numThreads * perThread));
+        int expected = 0;
+        for (auto x : result) {
+            assert(x == expected++);
+        }
+
+        // A throwing update publishes nothing.
+        bool thrown = false;
+        try {
+            a.update([](T const&) -> T { throw std::runtime_error("update"); });
+        } catch (std::runtime_error const&) {
+            thrown = true;
+        }
+        assert(thrown);
+        assert(a.load().size() == result.size());
+    }
+}
+
+// Counts live allocations, and deallocations made on threads other
+// than the main thread.
+std::atomic<long> liveAllocations(0);
+std::atomic<long> offThreadFrees(0);
+std::thread::id mainThread;
+
+template <typename T>
+struct CountingAllocator {
+    typedef T value_type;
+    CountingAllocator() { }
+    template <typename U>
+    CountingAllocator(CountingAllocator<U> const&) { }
+    T* allocate(size_t n) {
+        ++liveAllocations;
+        return std::allocator<T>().allocate(n);
+    }
+    void deallocate(T *ptr, size_t n) {
+        --liveAllocations;
+        if (std::this_thread::get_id() != mainThread) ++offThreadFrees;
+        std::allocator<T>().deallocate(ptr, n);
+    }
+    template <typename U>
+    bool operator==(CountingAllocator<U> const&) const { return true; }
+    template <typename U>
+    bool operator!=(CountingAllocator<U> const&) const { return false; }
+};
+
+void test_reclamation() {
+    typedef Treap<int, std::less<int>, CountingAllocator<int> > CountedTreap;
+    typedef TreapNode<int, CountingAllocator<int> > Node;
+    mainThread = std::this_thread::get_id();
+
+    // Dropping a degenerate (list shaped) tree doesn't recurse.
+    {
+        Node::NodePtrType chain;
+        for (int i = 0; i < 1000000; ++i) {
+            chain = Node::create(i, i, i + 1, std::move(chain), nullptr);
+        }
+        // Share a part of it with another pointer.
+        Node::NodePtrType middle = chain;
+        for (int i = 0; i < 500000; ++i) {
+            middle = middle->left;
+        }
+        chain.reset();
+        assert(liveAllocations == 500000);
+        middle.reset();
+        assert(liveAllocations == 0);
+    }
+
+    // Versions sharing nodes free exactly the ones nobody else uses.
+    {
+        vector<int> seq;
+        for (int i = 0; i < 10000; ++i) seq.push_back(i);
+        CountedTreap base(seq.begin(), seq.end());
+        CountedTreap derived = base.insert(-1).erase(5000);
+        base = CountedTreap();
+        assert(liveAllocations == long(derived.size()));
+        derived = CountedTreap();
+        assert(liveAllocations == 0);
+    }
+
+    // With the background reclaimer, dropped versions are freed on
+    // its thread.
+    TreapReclaimer &reclaimer = TreapReclaimer::instance();
+    reclaimer.start();
+    assert(reclaimer.isRunning());
+    {
+        vector<int> seq;
+        for (int i = 0; i < 100000; ++i) seq.push_back(i);
+        CountedTreap t(seq.begin(), seq.end());
+        CountedTreap t2 = t.insert(7);
+        const long allocated = liveAllocations;
+        t = CountedTreap();
+        t2 = CountedTreap();
+        reclaimer.drain();
+        assert(reclaimer.pending() == 0);
+        assert(liveAllocations == 0);
+        assert(offThreadFrees == allocated);
+    }
+    {
+        CountedTreap t;
+        for (int i = 0; i < 100; ++i) t = t.insert(i);
+    }
+    reclaimer.stop();
+    assert(!reclaimer.isRunning());
+    assert(liveAllocations == 0);
+
+    offThreadFrees = 0;
+    {
+        CountedTreap t;
+        t = t.insert(1);
+    }
+    assert(liveAllocations == 0);
+    assert(offThreadFrees == 0);
+}
+
+void test_snapshots() {
+    vector<int> seq;
+    for (int i = 0; i < 5000; ++i) {
+        seq.push_back((i * 7919) % 3000);
+    }
+    Treap<int> t(seq.begin(), seq.end());
+    t = t.insert(-5).erase(seq[10]);
+    multiset<int> expected(seq.begin(), seq.end());
+    expected.insert(-5);
+    expected.erase(expected.find(seq[10]));
+
+    // Streams keep the shape and heap keys.
+    std::stringstream buffer;
+    assert(t.save(buffer));
+    Treap<int> loaded = Treap<int>::load(buffer);
+    assert(buffer);
+    assert(loaded.size() == t.size());
+    assert(std::equal(loaded.begin(), loaded.end(), expected.begin()));
+    std::ostringstream saved1, saved2;
+    t.save(saved1);
+    loaded.save(saved2);
+    assert(saved1.str() == saved2.str());
+
+    std::stringstream emptyBuffer;
+    Treap<int>().save(emptyBuffer);
+    assert(Treap<int>::load(emptyBuffer).empty());
+
+    std::stringstream garbage("not a snapshot at all, not a snapshot at all");
+    assert(Treap<int>::load(garbage).empty());
+    assert(garbage.fail());
+
+    // Memory mapped snapshots
+    char path[] = "/tmp/treap_snapshot_XXXXXX";
+    const int fd = mkstemp(path);
+    assert(fd >= 0);
+    assert(t.save(fd));
+    close(fd);
+
+    TreapSnapshot<int> snapshot;
+    assert(!snapshot.is_open());
+    assert(snapshot.open(path));
+    assert(snapshot.size() == expected.size());
+    assert(std::equal(snapshot.begin(), snapshot.end(), expected.begin()));
+    for (int key = -10; key < 3010; key += 7) {
+        assert(snapshot.exists(key) == (expected.count(key) > 0));
+        assert(snapshot.count(key) == expected.count(key));
+        assert(snapshot.lower_bound(key) - snapshot.begin() ==
+               std::distance(expected.begin(), expected.lower_bound(key)));
+        assert(snapshot.upper_bound(key) - snapshot.begin() ==
+               std::distance(expected.begin(), expected.upper_bound(key)));
+    }
+    assert(snapshot.find(3000) == snapshot.end());
+    assert(snapshot.begin()[5] == *std::next(expected.begin(), 5));
+
+    // Modifications start from a rebuilt treap.
+    Treap<int> modified = snapshot.insert(100000);
+    assert(modified.size() == expected.size() + 1);
+    assert(*(--modified.end()) == 100000);
+    std::ostringstream saved3;
+    snapshot.treap().save(saved3);
+    assert(saved3.str() == saved1.str());
+    assert(snapshot.erase(-5).size() == expected.size() - 1);
+
+    // Summaries are recomputed.
+    TreapSnapshot<int, std::less<int>, std::allocator<int>, TreapSumSummary<long> > summed;
+    assert(summed.open(path));
+    assert(summed.treap().aggregate() == std::accumulate(expected.begin(), expected.end(), 0L));
+
+    // Corrupt records are reported when the tree is rebuilt.
+    {
+        const int wfd = ::open(path, O_WRONLY);
+        assert(wfd >= 0);
+        const uint64_t bogusSize = 12345;
+        assert(pwrite(wfd, &bogusSize, sizeof(bogusSize),
+                      sizeof(TreapSnapshotHeader) +
+                      offsetof(TreapSnapshotRecord<int>, subtreeSize)) ==
+               sizeof(bogusSize));
+        close(wfd);
+        TreapSnapshot<int> corrupt;
+        assert(corrupt.open(path));
+        bool threw = false;
+        try {
+            corrupt.insert(1);
+        } catch (std::runtime_error const&) {
+            threw = true;
+        }
+        assert(threw);
+    }
+
+    // Snapshots of another element type are rejected.
+    TreapSnapshot<pair<int, int> > wrongType;
+    assert(!wrongType.open(path));
+    unlink(path);
+    assert(!wrongType.open(path));
+}
+
+void test_delta_log() {
+    vector<int> seq;
+    for (int i = 0; i < 2000; ++i) {
+        seq.push_back((i * 7919) % 1500);
+    }
+    Treap<int> t(seq.begin(), seq.end());
+    std::stringstream base;
+    t.save(base);
+    TreapDeltaWriter<int> writer(t);
+    TreapDeltaReplayer<int> replica;
+    assert(replica.load(base));
+
+    auto sameVersion = [](Treap<int> const &a, Treap<int> const &b) {
+        std::ostringstream savedA, savedB;
+        a.save(savedA);
+        b.save(savedB);
+        return savedA.str() == savedB.str();
+    };
+    assert(sameVersion(replica.version(), t));
+
+    for (int i = 0; i < 200; ++i) {
+        const int key = (i * 389) % 1600;
+        switch (i % 4) {
+        case 0: t = t.insert(key); break;
+        case 1: t = t.erase(key); break;
+        case 2: t = t.update(key, key); break;
+        default: t = t.insert(key).insert(key + 1).erase(key + 2); break;
+        }
+        std::stringstream delta;
+        assert(writer.write(t, delta));
+        // Only the new path nodes are written.
+        assert(delta.str().size() <
+               sizeof(TreapDeltaHeader) + 200 * (sizeof(TreapDeltaRecord<int>) + sizeof(uint64_t)));
+        assert(replica.apply(delta));
+        assert(sameVersion(replica.version(), t));
+    }
+    assert(writer.sequence() == 200 && replica.sequence() == 200);
+
+    // Writing the same version again changes nothing.
+    std::stringstream same;
+    writer.write(t, same);
+    assert(same.str().size() == sizeof(TreapDeltaHeader));
+    assert(replica.apply(same));
+
+    // Deltas can't be applied twice or out of order.
+    Treap<int> next = t.insert(5);
+    Treap<int> last = next.insert(6);
+    std::stringstream delta1, delta2;
+    writer.write(next, delta1);
+    writer.write(last, delta2);
+    std::stringstream copy2(delta2.str());
+    assert(!replica.apply(delta2));
+    assert(replica.apply(delta1));
+    assert(replica.apply(copy2));
+    std::stringstream again(delta1.str());
+    assert(!replica.apply(again));
+    assert(sameVersion(replica.version(), last));
+
+    // Unrelated versions and empty versions are written in full.
+    Treap<int> other(seq.begin(), seq.begin() + 10);
+    std::stringstream full, empty;
+    writer.write(other, full);
+    writer.write(Treap<int>(), empty);
+    assert(replica.apply(full));
+    assert(sameVersion(replica.version(), other));
+    assert(replica.apply(empty));
+    assert(replica.version().empty());
+
+    std::stringstream garbage("not a delta at all, not a delta at all, not a delta");
+    assert(!replica.apply(garbage));
+    std::stringstream garbageBase("not a snapshot");
+    assert(!replica.load(garbageBase));
+    assert(replica.version().empty());
+}
+
 int main() {
     test_construct();
     test_insertion();
@@ -238,4 +1547,26 @@ int main() {
     test_update();
     test_count();
     test_iterators();
+    test_versions();
+    test_pool_allocator();
+    test_compact_layout();
+    test_priorities();
+    test_transient();
+    test_split_join();
+    test_hinted_insert();
+    test_range_erase();
+    test_rank_select();
+    test_parallel_algorithms();
+    test_set_operations();
+    test_bulk_load();
+    test_batch();
+    test_iterator_equality();
+    test_stats();
+    test_memory_report();
+    test_aggregate();
+    test_persistent_map();
+    test_atomic_treap();
+    test_reclamation();
+    test_snapshots();
+    test_delta_log();
 }
@@ -1,1002 +1,4984 @@
 /* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
 #include <iostream>
 #include <iterator>
+#include <limits>
 #include <memory>
+#include <mutex>
 #include <new>
 #include <queue>
 #include <set>
 #include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
 #include <assert.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 using namespace std;
 
 namespace dhruvbird { namespace functional {
-  enum class ChildDirection {
-    LEFT, RIGHT
+  enum class SetOperation {
+    UNION, INTERSECTION, DIFFERENCE
   };
 
-  const int _treap_random_seed = 6781;
+  // Parallel algorithms don't fork for sub-problems with fewer
+  // elements than this.
+  const size_t _treap_parallel_grain = 4096;
 
-  template <typename T, typename LessThan>
+  template <typename T, typename LessThan, typename Alloc, typename Summary, typename Layout,
+            typename Priority>
   class Treap;
 
-  template <typename T>
-  struct TreapNode {
-    T data;
-    int heapKey;
-    size_t subtreeSize;
-    mutable std::shared_ptr<TreapNode> left, right;
+  template <typename T, typename LessThan, typename Alloc, typename Summary, typename Layout,
+            typename Priority>
+  class TransientTreap;
 
-    TreapNode(T const &_data,
-              int _heapKey,
-              size_t _subtreeSize,
-              std::shared_ptr<TreapNode> _left = nullptr,
-              std::shared_ptr<TreapNode> _right = nullptr)
-      : data(_data), heapKey(_heapKey), subtreeSize(_subtreeSize),
-        left(_left), right(_right) { }
+  template <typename K, typename V, typename LessThan, typename Alloc>
+  class PersistentMap;
 
-    bool isLeftChildOf(std::shared_ptr<TreapNode> const &parent) const {
-      return parent->left.get() == this;
-    }
+  template <typename T, typename LessThan, typename Alloc, typename Summary, typename Layout,
+            typename Priority>
+  class AtomicTreap;
 
-    bool isRightChildOf(std::shared_ptr<TreapNode> const &parent) const {
-      return parent->right.get() == this;
-    }
+  template <typename T, typename LessThan, typename Alloc, typename Summary, typename Layout,
+            typename Priority>
+  class TreapSnapshot;
 
-    std::shared_ptr<TreapNode> clone() const {
-      auto copy = std::make_shared<TreapNode>
-        (this->data,
-         this->heapKey,
-         this->subtreeSize,
-         this->left,
-         this->right);
-      return copy;
-    }
-  };
+  template <typename T, typename LessThan, typename Alloc, typename Summary, typename Layout,
+            typename Priority>
+  class TreapDeltaWriter;
 
-  /**
-   * Rotate 'node' left around its 'parent'.
-   */
-  template <typename T>
-  void rotateLeft(std::shared_ptr<TreapNode<T> > &node,
-                  std::shared_ptr<TreapNode<T> > &parent,
-                  std::shared_ptr<TreapNode<T> > &grandParent) {
-#if 0
-    fprintf(stderr, "rotateLeft(%d[%d], %d[%d])\n", node->data, node->heapKey,
-      parent->data, parent->heapKey);
-#endif
-    assert(node->isRightChildOf(parent));
-    auto nLeft = node->left;
-    node->left = parent;
-    parent->right = nLeft;
-    if (grandParent.get()) {
-      if (parent->isLeftChildOf(grandParent)) {
-        grandParent->left = node;
-      } else {
-        grandParent->right = node;
-      }
-    }
-    node.swap(parent);
-  }
+  template <typename T, typename LessThan, typename Alloc, typename Summary, typename Layout,
+            typename Priority>
+  class TreapDeltaReplayer;
 
   /**
-   * Rotate 'node' right around its 'parent'.
+   * The reference count embedded in every TreapNode. Nodes are shared
+   * between treap versions, so by default the count is atomic. Define
+   * TREAP_SINGLE_THREADED before including this header to use a plain
+   * counter when treaps are never shared across threads.
    */
-  template <typename T>
-  void rotateRight(std::shared_ptr<TreapNode<T> > &node,
-                   std::shared_ptr<TreapNode<T> > &parent,
-                   std::shared_ptr<TreapNode<T> > &grandParent) {
-#if 0
-    fprintf(stderr, "rotateRight(%d[%d], %d[%d])\n", node->data, node->heapKey,
-      parent->data, parent->heapKey);
+  class TreapRefCount {
+#if defined TREAP_SINGLE_THREADED
+    unsigned int count;
+#else
+    std::atomic<unsigned int> count;
 #endif
-    assert(node->isLeftChildOf(parent));
-    auto nRight = node->right;
-    node->right = parent;
-    parent->left = nRight;
-    if (grandParent.get()) {
-      if (parent->isLeftChildOf(grandParent)) {
-        grandParent->left = node;
-      } else {
-        grandParent->right = node;
-      }
+
+  public:
+    TreapRefCount() : count(0) { }
+    TreapRefCount(TreapRefCount const&) = delete;
+    TreapRefCount& operator=(TreapRefCount const&) = delete;
+
+#if defined TREAP_SINGLE_THREADED
+    void acquire(unsigned int n = 1) { count += n; }
+    bool release(unsigned int n = 1) { return (count -= n) == 0; }
+    unsigned int get() const { return count; }
+#else
+    void acquire(unsigned int n = 1) { count.fetch_add(n, std::memory_order_relaxed); }
+    /**
+     * Returns true if the last reference was dropped.
+     */
+    bool release(unsigned int n = 1) {
+      return count.fetch_sub(n, std::memory_order_acq_rel) == n;
     }
-    node.swap(parent);
-  }
+    unsigned int get() const { return count.load(std::memory_order_acquire); }
+#endif
+  };
 
   /**
-   * Rotate 'node' up (left or right) around its 'parent'.
+   * Counters describing the work done by treap operations on the
+   * current thread, broken down by the kind of operation. They are
+   * only collected if TREAP_STATS is defined before including this
+   * header; otherwise the counters compile away and always read 0.
+   *
+   * Read them with TreapStats::local(). Nodes freed when a version
+   * is dropped are attributed to whatever operation is running at
+   * the time (usually OTHER).
    */
-  template <typename T>
-  void rotateUp(std::shared_ptr<TreapNode<T> > &node,
-                std::shared_ptr<TreapNode<T> > &parent,
-                std::shared_ptr<TreapNode<T> > &grandParent) {
-    assert(node->isLeftChildOf(parent) || node->isRightChildOf(parent));
-#if !defined NDEBUG
-    // Note: Comparators are broken here.
-    if (node->data < parent->data) {
-      assert(node->isLeftChildOf(parent));
-    } else if (parent->data < node->data) {
-      assert(node->isRightChildOf(parent));
+  struct TreapOperationStats {
+    size_t calls;
+    size_t clones;
+    size_t rotations;
+    size_t comparisons;
+    // Nodes visited while searching down from the root.
+    size_t pathNodes;
+    size_t nodesAllocated;
+    size_t nodesFreed;
+    size_t bytesAllocated;
+    size_t bytesFreed;
+
+    TreapOperationStats& operator+=(TreapOperationStats const &rhs) {
+      this->calls += rhs.calls;
+      this->clones += rhs.clones;
+      this->rotations += rhs.rotations;
+      this->comparisons += rhs.comparisons;
+      this->pathNodes += rhs.pathNodes;
+      this->nodesAllocated += rhs.nodesAllocated;
+      this->nodesFreed += rhs.nodesFreed;
+      this->bytesAllocated += rhs.bytesAllocated;
+      this->bytesFreed += rhs.bytesFreed;
+      return *this;
     }
-#endif
+  };
 
-    if (node->isLeftChildOf(parent)) {
-      rotateRight(node, parent, grandParent);
-    } else {
-      rotateLeft(node, parent, grandParent);
-    }
-    // 'parent' and 'node' are now swapped. First set the size on
-    // 'node' and then on 'parent'.
-    node->subtreeSize = (node->left ? node->left->subtreeSize : 0) +
-      (node->right ? node->right->subtreeSize : 0) + 1;
-    parent->subtreeSize = (parent->left ? parent->left->subtreeSize : 0) +
-      (parent->right ? parent->right->subtreeSize : 0) + 1;
-  }
+  class TreapStats {
+  public:
+    enum Operation {
+      OTHER, INSERT, ERASE, UPDATE, LOOKUP, SPLIT_JOIN, SET_OPERATION,
+      BATCH, BUILD, NUM_OPERATIONS
+    };
 
-  class RNGIterator : public std::iterator<std::forward_iterator_tag, const int> {
-    unsigned int seed;
-    int rno;
+#if defined TREAP_STATS
+    static const bool enabled = true;
+#else
+    static const bool enabled = false;
+#endif
 
-  public:
-    RNGIterator (unsigned int seed_) : seed(seed_), rno(0) {
-      ++(*this);
-    }
+    TreapOperationStats operations[NUM_OPERATIONS];
 
-    RNGIterator& operator++() {
-      this->rno = rand_r(&this->seed);
-      return *this;
+    /**
+     * The counters of the current thread.
+     */
+    static TreapStats& local() {
+      static thread_local TreapStats stats;
+      return stats;
     }
 
-    RNGIterator operator++(int) {
-      RNGIterator ret = *this;
-      ++(*this);
-      return ret;
+    /**
+     * The counters of the operation currently running on this thread.
+     */
+    static TreapOperationStats& current() {
+      return local().operations[currentOperation()];
     }
 
-    int operator*() const {
-      return this->rno;
+    static Operation& currentOperation() {
+      static thread_local Operation op = OTHER;
+      return op;
     }
 
-  };
-
-  template <typename T, typename LessThan=std::less<T> >
-  class TreapIterator : public std::iterator<std::random_access_iterator_tag, const T> {
-    typedef TreapNode<T> NodeType;
-    typedef std::shared_ptr<NodeType> NodePtrType;
-    typedef std::vector<NodePtrType> PtrsType;
-    // 'ptrs' stores all node pointers from root up to the current
-    // node, following both the left and right children. It doesn't
-    // matter which child we follow since finding the successor
-    // [operator++] or the predecessor [operator--] can be done
-    // entirely by looking at the current node and the path from the
-    // root to this node, all of which are stored in 'ptrs'.
-    //
-    // Storing 'ptrs' allows us to achieve amortized O(1) cost of
-    // iterating over the whole collection. If we re-computed the path
-    // from the root to the current node every time we wanted to visit
-    // the parent node, we would have to incur a cost of O(n log n) to
-    // iterate over the entire collection.
-    //
-    PtrsType ptrs;
-    NodePtrType root;
-    friend class Treap<T, LessThan>;
-
-    /**
-     * Returns the current state of the iterator. i.e. The path from
-     * the root node to the current node.
-     */
-    PtrsType const& getRootToNodePtrs() const {
-      return this->ptrs;
+    static char const* operationName(Operation op) {
+      static char const *names[NUM_OPERATIONS] = {
+        "other", "insert", "erase", "update", "lookup", "split_join",
+        "set_operation", "batch", "build"
+      };
+      return names[op];
     }
 
     /**
-     * Returns the rank of the iterator '*this'. i.e. It returns the
-     * number of elements < the element pointed to by '*this'.
+     * Attributes the work done during its lifetime to 'op', unless an
+     * outer operation is already running. i.e. Nested operations are
+     * counted against the outermost one.
      */
-    size_t rank() const {
-      if (!this->root) return 0;
-      if (this->ptrs.empty()) {
-        /* This is the end() iterator */
-        return this->root->subtreeSize;
+    class Scope {
+      bool outermost;
+
+    public:
+      explicit Scope(Operation op) : outermost(currentOperation() == OTHER) {
+        if (this->outermost) {
+          currentOperation() = op;
+          ++current().calls;
+        }
       }
 
-      /* Stores the # of elements >= *this.
-       *
-       * At every step of the for loop, 'count' stores the number of
-       * nodes >= ptrs[i] plus the count of the elements under the
-       * left child of ptrs[i]. To compensate for the excess
-       * (left-child counts), we subtract this value right at the end.
-       *
-       */
-      size_t count = 0;
-      count = ptrs[0]->subtreeSize;
-      for (size_t i = 1; i < ptrs.size(); ++i) {
-        if (ptrs[i]->isRightChildOf(ptrs[i-1])) {
-          // Everything to the right is kosher.
-          count -= ptrs[i-1]->subtreeSize;
-          count += ptrs[i]->subtreeSize;
+      ~Scope() {
+        if (this->outermost) {
+          currentOperation() = OTHER;
         }
       }
-      count -= (ptrs.back()->left ? ptrs.back()->left->subtreeSize : 0);
-      // Return # of elements < *this
-      return root->subtreeSize - count;
+    };
+
+    TreapStats() {
+      this->reset();
+    }
+
+    void reset() {
+      std::fill(reinterpret_cast<char*>(this->operations),
+                reinterpret_cast<char*>(this->operations + NUM_OPERATIONS), 0);
+    }
+
+    TreapOperationStats total() const {
+      TreapOperationStats sum = TreapOperationStats();
+      for (auto const &op : this->operations) {
+        sum += op;
+      }
+      return sum;
     }
 
     /**
-     * Moves the current iterator to point to the rank'th
-     * element. Ranks start from 0. The k'th element is the k'th
-     * smallest element in the treap.
+     * Print one line of counters per operation.
      */
-    void moveToRank(const size_t rank) {
-      assert(rank > 0 && this->root || rank == 0);
-      if (!this->root) return;
-      assert(rank <= this->root->subtreeSize);
-      if (rank == this->root->subtreeSize) {
-        // Move to end()
-        this->ptrs.clear();
-        return;
-      }
-      PtrsType path(1, this->root);
-      size_t currRank = this->root->left ? this->root->left->subtreeSize : 0;
-      while (currRank != rank) {
-        if (currRank < rank) {
-          path.push_back(path.back()->right);
-          currRank += 1;
-        } else {
-          path.push_back(path.back()->left);
-          currRank -= path.back()->subtreeSize;
-        }
-        currRank += path.back()->left ? path.back()->left->subtreeSize : 0;
+    std::ostream& print(std::ostream &out) const {
+      for (int i = 0; i < NUM_OPERATIONS; ++i) {
+        TreapOperationStats const &op = this->operations[i];
+        out << operationName(static_cast<Operation>(i))
+            << ": calls=" << op.calls
+            << " clones=" << op.clones
+            << " rotations=" << op.rotations
+            << " comparisons=" << op.comparisons
+            << " pathNodes=" << op.pathNodes
+            << " nodesAllocated=" << op.nodesAllocated
+            << " nodesFreed=" << op.nodesFreed
+            << " bytesAllocated=" << op.bytesAllocated
+            << " bytesFreed=" << op.bytesFreed << "\n";
       }
-      ptrs = std::move(path);
+      return out;
     }
+  };
 
-  public:
-    TreapIterator() { }
-    TreapIterator(PtrsType &&_ptrs, NodePtrType _root)
-      : ptrs(_ptrs), root(_root) { }
+#if defined TREAP_STATS
+#define TREAP_STATS_SCOPE(OP) TreapStats::Scope _treap_stats_scope(TreapStats::OP)
+#define TREAP_STATS_ADD(FIELD, N) (TreapStats::current().FIELD += (N))
+#else
+#define TREAP_STATS_SCOPE(OP) do { } while (0)
+#define TREAP_STATS_ADD(FIELD, N) do { } while (0)
+#endif
 
-    TreapIterator& operator++() {
-      assert(!ptrs.empty());
-      auto tmp = ptrs.back();
-      if (tmp->right.get()) {
-        tmp = tmp->right;
-        ptrs.push_back(tmp);
-        while (tmp->left.get()) {
-          tmp = tmp->left;
-          ptrs.push_back(tmp);
-        }
-        return *this;
-      }
-      if (ptrs.size() > 1) {
-        size_t ptrx = ptrs.size() - 1;
-        // Right-Child
-        while (ptrs.size() > 1 && ptrs[ptrx]->isRightChildOf(ptrs[ptrx - 1])) {
-          --ptrx;
-          ptrs.pop_back();
-        }
-        if (ptrs.size() > 1 && ptrs[ptrx]->isLeftChildOf(ptrs[ptrx - 1])) {
-          ptrs.pop_back();
-          return *this;
-        }
-      }
-      assert(ptrs.size() == 1);
-      // Clean-up since ptrs.size() == 1
-      ptrs.pop_back();
-      return *this;
+  /**
+   * Wraps the comparator 'LessThan' to count comparisons in
+   * TreapStats.
+   */
+  template <typename LessThan>
+  struct TreapCountingCompare {
+    template <typename A, typename B>
+    bool operator()(A const &lhs, B const &rhs) const {
+      TREAP_STATS_ADD(comparisons, 1);
+      return LessThan()(lhs, rhs);
     }
+  };
 
-    TreapIterator operator++(int) const {
-      TreapIterator it = *this;
-      ++*this;
-      return it;
+  /**
+   * An intrusive smart pointer to a reference counted node. 'Node'
+   * must have a 'refs' member of type TreapRefCount and a static
+   * 'destroy(Node*)' function which is called when the last
+   * reference goes away.
+   *
+   * Unlike std::shared_ptr<>, this needs no separate control block
+   * and is only as large as a raw pointer.
+   */
+  template <typename Node>
+  class TreapNodePtr {
+    Node *ptr;
+
+  public:
+    TreapNodePtr() : ptr(nullptr) { }
+    TreapNodePtr(std::nullptr_t) : ptr(nullptr) { }
+    explicit TreapNodePtr(Node *_ptr) : ptr(_ptr) {
+      if (this->ptr) this->ptr->refs.acquire();
+    }
+    TreapNodePtr(TreapNodePtr const &rhs) : ptr(rhs.ptr) {
+      if (this->ptr) this->ptr->refs.acquire();
+    }
+    TreapNodePtr(TreapNodePtr &&rhs) : ptr(rhs.ptr) {
+      rhs.ptr = nullptr;
+    }
+    ~TreapNodePtr() {
+      this->reset();
     }
 
-    TreapIterator& operator--() {
-      if (ptrs.empty()) {
-        auto tmp = this->root;
-        while (tmp) {
-          ptrs.push_back(tmp);
-          tmp = tmp->right;
-        }
-        return *this;
-      }
+    TreapNodePtr& operator=(TreapNodePtr const &rhs) {
+      TreapNodePtr(rhs).swap(*this);
+      return *this;
+    }
 
-      auto tmp = ptrs.back();
-      if (tmp->left.get()) {
-        tmp = tmp->left;
-        ptrs.push_back(tmp);
-        while (tmp->right.get()) {
-          tmp = tmp->right;
-          ptrs.push_back(tmp);
-        }
-        return *this;
-      }
-      if (ptrs.size() > 1) {
-        size_t ptrx = ptrs.size() - 1;
-        // Right-Child
-        while (ptrs.size() > 1 && ptrs[ptrx]->isLeftChildOf(ptrs[ptrx - 1])) {
-          --ptrx;
-          ptrs.pop_back();
-        }
-        if (ptrs.size() > 1 && ptrs[ptrx]->isRightChildOf(ptrs[ptrx - 1])) {
-          ptrs.pop_back();
-          return *this;
-        }
-      }
-      // We backed up all the way before the first node. This is an
-      // error.
-      assert(ptrs.size() != 1);
+    TreapNodePtr& operator=(TreapNodePtr &&rhs) {
+      TreapNodePtr(std::move(rhs)).swap(*this);
       return *this;
     }
 
-    TreapIterator operator--(int) const {
-      TreapIterator it = *this;
-      --*this;
-      return it;
+    void reset() {
+      Node *old = this->ptr;
+      this->ptr = nullptr;
+      if (old && old->refs.release()) {
+        Node::destroy(old);
+      }
     }
 
-    TreapIterator& operator+=(const off_t offset) {
-      this->moveToRank(static_cast<off_t>(this->rank()) + offset);
-      return *this;
+    void swap(TreapNodePtr &rhs) {
+      std::swap(this->ptr, rhs.ptr);
     }
 
-    TreapIterator& operator-=(const off_t offset) {
-      this->moveToRank(static_cast<off_t>(this->rank()) - offset);
-      return *this;
+    /**
+     * Returns a pointer owning a reference to 'ptr' that the caller
+     * has already counted in 'ptr->refs'.
+     */
+    static TreapNodePtr adopt(Node *ptr) {
+      TreapNodePtr result;
+      result.ptr = ptr;
+      return result;
     }
 
     /**
-     * Cost: O(log n)
+     * Gives up the reference held by this pointer without dropping
+     * it, and returns the raw pointer.
      */
-    off_t operator-(TreapIterator const& other) const {
-      const off_t otherRank = other.rank();
-      const off_t thisRank = this->rank();
-      return thisRank - otherRank;
+    Node* detach() {
+      Node *old = this->ptr;
+      this->ptr = nullptr;
+      return old;
     }
 
-    T const& operator[](off_t offset) const {
-      if (offset == 0) return **this;
-      auto other = *this;
-      other += offset;
-      return *other;
+    Node* get() const { return this->ptr; }
+    Node* operator->() const { return this->ptr; }
+    Node& operator*() const { return *this->ptr; }
+    explicit operator bool() const { return this->ptr != nullptr; }
+
+    bool operator==(TreapNodePtr const &rhs) const { return this->ptr == rhs.ptr; }
+    bool operator!=(TreapNodePtr const &rhs) const { return this->ptr != rhs.ptr; }
+  };
+
+  /**
+   * A slab allocator for fixed size blocks of 'Size' bytes. Memory is
+   * carved out of slabs of 'BatchSize' blocks, and freed blocks are
+   * kept on a per-thread free list so that the next allocation on
+   * the same thread (typically the next path copy) reuses them
+   * without taking a lock. Free lists that grow too large are handed
+   * back to a global list in batches, from where other threads can
+   * pick them up.
+   *
+   * Slabs are never returned to the system. This keeps the pool
+   * usable while static objects holding treaps are being destroyed.
+   */
+  template <size_t Size, size_t Align>
+  class TreapSlabPool {
+    union Block {
+      Block *next;
+      typename std::aligned_storage<Size, Align>::type storage;
+    };
+
+    static const size_t BatchSize = 256;
+
+    struct Chain {
+      Block *head;
+      size_t count;
+    };
+
+    struct Global {
+      std::mutex mutex;
+      std::vector<Chain> chains;
+    };
+
+    // Must be trivially destructible so that it can still be used by
+    // nodes freed after this thread's thread_local objects have been
+    // destroyed.
+    struct LocalCache {
+      Block *head;
+      size_t count;
+      bool registered;
+      bool exited;
+    };
+
+    struct LocalCacheFlusher {
+      ~LocalCacheFlusher() {
+        LocalCache &cache = TreapSlabPool::local();
+        TreapSlabPool::release(cache.head, cache.count);
+        cache.head = nullptr;
+        cache.count = 0;
+        cache.exited = true;
+      }
+    };
+
+    static Global& global() {
+      // Intentionally leaked. See above.
+      static Global *g = new Global;
+      return *g;
+    }
+
+    static LocalCache& local() {
+      static thread_local LocalCache cache;
+      if (!cache.registered) {
+        // On first use by this thread, whether it allocates or only
+        // frees (as reclaimer and task pool threads do), so that the
+        // blocks it caches are handed back when it exits.
+        cache.registered = true;
+        static thread_local LocalCacheFlusher flusher;
+        (void)flusher;
+      }
+      return cache;
+    }
+
+    static void release(Block *head, size_t count) {
+      if (!head) return;
+      Global &g = global();
+      std::lock_guard<std::mutex> lock(g.mutex);
+      g.chains.push_back(Chain{head, count});
+    }
+
+    static void refill(LocalCache &cache) {
+      Global &g = global();
+      {
+        std::lock_guard<std::mutex> lock(g.mutex);
+        if (!g.chains.empty()) {
+          cache.head = g.chains.back().head;
+          cache.count = g.chains.back().count;
+          g.chains.pop_back();
+          return;
+        }
+      }
+      Block *slab = static_cast<Block*>(::operator new(sizeof(Block) * BatchSize));
+      for (size_t i = 0; i + 1 < BatchSize; ++i) {
+        slab[i].next = &slab[i + 1];
+      }
+      slab[BatchSize - 1].next = nullptr;
+      cache.head = slab;
+      cache.count = BatchSize;
+    }
+
+  public:
+    static void* allocate() {
+      LocalCache &cache = local();
+      if (!cache.head) {
+        refill(cache);
+      }
+      Block *block = cache.head;
+      cache.head = block->next;
+      --cache.count;
+      return block;
+    }
+
+    static void deallocate(void *ptr) {
+      Block *block = static_cast<Block*>(ptr);
+      LocalCache &cache = local();
+      if (cache.exited) {
+        block->next = nullptr;
+        release(block, 1);
+        return;
+      }
+      block->next = cache.head;
+      cache.head = block;
+      if (++cache.count < 2 * BatchSize) {
+        return;
+      }
+      // Hand the oldest BatchSize blocks back to the global list.
+      Block *tail = cache.head;
+      for (size_t i = 1; i < BatchSize; ++i) {
+        tail = tail->next;
+      }
+      release(tail->next, cache.count - BatchSize);
+      tail->next = nullptr;
+      cache.count = BatchSize;
+    }
+  };
+
+  /**
+   * An allocator that serves single objects from a TreapSlabPool<>
+   * shared by all objects of the same size and alignment. Pass it as
+   * the 'Alloc' parameter of Treap<> to pool node allocations:
+   *
+   *   Treap<int, std::less<int>, TreapPoolAllocator<int> > t;
+   *
+   */
+  template <typename T>
+  class TreapPoolAllocator {
+    typedef TreapSlabPool<sizeof(T), alignof(T)> PoolType;
+
+  public:
+    typedef T value_type;
+
+    TreapPoolAllocator() { }
+    template <typename U>
+    TreapPoolAllocator(TreapPoolAllocator<U> const&) { }
+
+    T* allocate(size_t n) {
+      static_assert(alignof(T) <= alignof(std::max_align_t),
+                    "Over-aligned types are not supported");
+      if (n != 1) {
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+      }
+      return static_cast<T*>(PoolType::allocate());
+    }
+
+    void deallocate(T *ptr, size_t n) {
+      if (n != 1) {
+        ::operator delete(ptr);
+        return;
+      }
+      PoolType::deallocate(ptr);
+    }
+
+    template <typename U>
+    bool operator==(TreapPoolAllocator<U> const&) const { return true; }
+    template <typename U>
+    bool operator!=(TreapPoolAllocator<U> const&) const { return false; }
+  };
+
+  /**
+   * Frees dropped versions on a background thread. When a node loses
+   * its last reference (typically the root of a dropped version),
+   * freeing it and the nodes that only it references takes time
+   * proportional to their number, on the thread that dropped it.
+   * While the reclaimer is running, such nodes are instead queued in
+   * O(1) and freed by the reclaimer's thread.
+   *
+   * Nodes freed by the reclaimer are counted in its own thread's
+   * TreapStats. With TREAP_SINGLE_THREADED, start() does nothing,
+   * since node reference counts can't be updated from another
+   * thread.
+   */
+  class TreapReclaimer {
+    typedef void (*DestroyFunc)(void *node);
+    typedef std::pair<void*, DestroyFunc> Item;
+
+    std::atomic<bool> running;
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::condition_variable idle;
+    std::vector<Item> queue;
+    // Items taken off 'queue' that aren't freed yet.
+    size_t inFlight;
+    std::thread worker;
+
+    TreapReclaimer() : running(false), inFlight(0) { }
+
+    void workerLoop() {
+      std::vector<Item> batch;
+      std::unique_lock<std::mutex> lock(this->mutex);
+      while (true) {
+        this->wakeup.wait(lock, [this]() {
+            return !this->queue.empty() || !this->running.load();
+          });
+        if (this->queue.empty()) {
+          // Stopped, and everything is freed.
+          return;
+        }
+        batch.swap(this->queue);
+        this->inFlight = batch.size();
+        lock.unlock();
+        for (auto const &item : batch) {
+          item.second(item.first);
+        }
+        batch.clear();
+        lock.lock();
+        this->inFlight = 0;
+        if (this->queue.empty()) {
+          this->idle.notify_all();
+        }
+      }
+    }
+
+  public:
+    /**
+     * The reclaimer used by all treaps. It is never destroyed, so
+     * versions may be dropped during static destruction.
+     */
+    static TreapReclaimer& instance() {
+      static TreapReclaimer *reclaimer = new TreapReclaimer;
+      return *reclaimer;
+    }
+
+    /**
+     * Start freeing dropped nodes on a background thread.
+     */
+    void start() {
+#if !defined TREAP_SINGLE_THREADED
+      std::lock_guard<std::mutex> lock(this->mutex);
+      if (this->running.load()) return;
+      this->running.store(true);
+      this->worker = std::thread([this]() { this->workerLoop(); });
+#endif
+    }
+
+    /**
+     * Free everything queued so far, and go back to freeing dropped
+     * nodes on the thread that drops them.
+     */
+    void stop() {
+      {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        if (!this->running.load()) return;
+        this->running.store(false);
+      }
+      this->wakeup.notify_one();
+      this->worker.join();
+    }
+
+    bool isRunning() const {
+      return this->running.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Block until everything queued before this call is freed.
+     */
+    void drain() {
+      std::unique_lock<std::mutex> lock(this->mutex);
+      this->idle.wait(lock, [this]() {
+          return (this->queue.empty() && this->inFlight == 0) ||
+            !this->running.load();
+        });
+    }
+
+    /**
+     * The number of queued nodes that aren't freed yet.
+     */
+    size_t pending() {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      return this->queue.size() + this->inFlight;
+    }
+
+    /**
+     * Queue 'node' to be freed by destroy(node) on the background
+     * thread. Returns false (and does nothing) if the reclaimer isn't
+     * running.
+     */
+    bool defer(void *node, DestroyFunc destroy) {
+      if (!this->running.load(std::memory_order_relaxed)) return false;
+      {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        if (!this->running.load()) return false;
+        this->queue.push_back(Item(node, destroy));
+      }
+      this->wakeup.notify_one();
+      return true;
+    }
+  };
+
+  /**
+   * A Summary policy maintains an aggregate of every subtree in its
+   * root node, in the same way as 'subtreeSize'. It describes a
+   * monoid over the elements:
+   *
+   *   typedef ... value_type;
+   *   static value_type identity();
+   *   static value_type lift(T const &element);
+   *   static value_type combine(value_type const &lhs, value_type const &rhs);
+   *
+   * 'combine' must be associative, and 'identity' must be its
+   * identity element. It need not be commutative: elements are
+   * always combined in sorted order.
+   *
+   * TreapNoSummary maintains nothing, and is the default.
+   */
+  struct TreapNoSummary {
+    struct value_type { };
+    static value_type identity() { return value_type(); }
+    template <typename T>
+    static value_type lift(T const&) { return value_type(); }
+    static value_type combine(value_type, value_type) { return value_type(); }
+  };
+
+  /**
+   * Sum of the elements, starting at T().
+   */
+  template <typename T>
+  struct TreapSumSummary {
+    typedef T value_type;
+    static T identity() { return T(); }
+    static T lift(T const &element) { return element; }
+    static T combine(T const &lhs, T const &rhs) { return lhs + rhs; }
+  };
+
+  /**
+   * Smallest element. The summary of an empty range is the largest
+   * value of T, so T must be an arithmetic type.
+   */
+  template <typename T>
+  struct TreapMinSummary {
+    typedef T value_type;
+    static T identity() { return std::numeric_limits<T>::max(); }
+    static T lift(T const &element) { return element; }
+    static T combine(T const &lhs, T const &rhs) { return std::min(lhs, rhs); }
+  };
+
+  /**
+   * Largest element. The summary of an empty range is the lowest
+   * value of T, so T must be an arithmetic type.
+   */
+  template <typename T>
+  struct TreapMaxSummary {
+    typedef T value_type;
+    static T identity() { return std::numeric_limits<T>::lowest(); }
+    static T lift(T const &element) { return element; }
+    static T combine(T const &lhs, T const &rhs) { return std::max(lhs, rhs); }
+  };
+
+  /**
+   * Node layouts, selecting the integer type that holds subtree
+   * sizes. With TreapCompactLayout a node of a 4 byte element takes
+   * 32 bytes instead of 40 on 64-bit machines (2 pointers, the
+   * element, the heap key, the size and the reference count), but a
+   * treap may hold at most 2^32 - 1 elements (inserting more throws
+   * std::length_error). glibc's malloc puts
+   * both sizes in 48 byte chunks, so the saving only shows with an
+   * allocator that hands out exact sizes, such as
+   * TreapPoolAllocator.
+   */
+  struct TreapDefaultLayout {
+    typedef size_t size_type;
+  };
+
+  struct TreapCompactLayout {
+    typedef uint32_t size_type;
+  };
+
+  /**
+   * The splitmix64 finalizer: a bijection on 64 bit integers whose
+   * every output bit depends on every input bit.
+   */
+  inline uint64_t treapMix(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+  }
+
+  /**
+   * Priority policies, which pick the heap key of every new node. A
+   * policy is a default constructible class with
+   *
+   *   int operator()(T const &element) const;
+   *
+   * returning a heap key in [0, INT_MAX], and a 'keyed' constant
+   * which is true if the heap key is a function of the element.
+   *
+   * TreapRandomPriority is the default. It draws heap keys from a
+   * per-thread xorshift64* generator, so they are independent of the
+   * elements, of each other, and of the version a node is inserted
+   * into. Every thread gets a generator seeded from the number of
+   * threads that started drawing before it, so a single threaded
+   * program builds the same shapes on every run.
+   */
+  struct TreapRandomPriority {
+    static const bool keyed = false;
+
+    template <typename T>
+    int operator()(T const&) const {
+      return next();
+    }
+
+    static int next() {
+      static thread_local uint64_t state = initialState();
+      state ^= state >> 12;
+      state ^= state << 25;
+      state ^= state >> 27;
+      return static_cast<int>((state * 0x2545F4914F6CDD1DULL) >> 33);
+    }
+
+  private:
+    static uint64_t initialState() {
+      static std::atomic<uint64_t> threads(0);
+      return treapMix((threads.fetch_add(1) + 1) * 0x9E3779B97F4A7C15ULL) | 1;
+    }
+  };
+
+  /**
+   * Derives heap keys from Hash()(element), so (for distinct
+   * elements) the shape of a treap built by inserts, bulk loads and
+   * batches depends only on its contents and not on the order in
+   * which they arrived, or on the elements erased since. Equal
+   * elements get equal heap keys, so many duplicates make the tree
+   * deeper, as do inputs chosen by someone who knows the hash. The
+   * hash is mixed, so the identity std::hash of integers is fine.
+   */
+  template <typename T, typename Hash = std::hash<T> >
+  struct TreapKeyHashPriority {
+    static const bool keyed = true;
+
+    int operator()(T const &element) const {
+      return static_cast<int>(treapMix(Hash()(element)) >> 33);
+    }
+  };
+
+  /**
+   * Holds the summary of a node. Empty summaries (TreapNoSummary)
+   * are a base class of the node, and take no space in it.
+   */
+  template <typename V, bool Empty = std::is_empty<V>::value>
+  struct TreapSummaryStorage {
+    V summaryValue;
+
+    V const& summary() const { return this->summaryValue; }
+    void setSummary(V const &value) { this->summaryValue = value; }
+  };
+
+  template <typename V>
+  struct TreapSummaryStorage<V, true> {
+    V summary() const { return V(); }
+    void setSummary(V const&) { }
+  };
+
+  /**
+   * 'Alloc' is rebound to allocate TreapNode<> objects. It is default
+   * constructed wherever a node is allocated or freed, so all
+   * instances of it must be interchangeable.
+   */
+  template <typename T, typename Alloc = std::allocator<T>,
+            typename Summary = TreapNoSummary,
+            typename Layout = TreapDefaultLayout>
+  struct TreapNode : TreapSummaryStorage<typename Summary::value_type> {
+    typedef TreapNodePtr<TreapNode> NodePtrType;
+    typedef typename std::allocator_traits<Alloc>::template
+      rebind_alloc<TreapNode> NodeAllocator;
+    typedef std::allocator_traits<NodeAllocator> NodeAllocatorTraits;
+    typedef typename Layout::size_type size_type;
+
+    // The children come first, so that the smaller fields pack
+    // together after them.
+    mutable NodePtrType left, right;
+    T data;
+    int heapKey;
+    size_type subtreeSize;
+    mutable TreapRefCount refs;
+
+    TreapNode(T const &_data,
+              int _heapKey,
+              size_t _subtreeSize,
+              NodePtrType _left = nullptr,
+              NodePtrType _right = nullptr)
+      : left(std::move(_left)), right(std::move(_right)),
+        data(_data), heapKey(_heapKey), subtreeSize(_subtreeSize) {
+      this->setSummary(this->computeSummary());
+    }
+
+    /**
+     * Allocate a new node. This is the only way in which nodes
+     * should be created.
+     */
+    template <typename... Args>
+    static NodePtrType create(Args&&... args) {
+      NodeAllocator alloc;
+      TREAP_STATS_ADD(nodesAllocated, 1);
+      TREAP_STATS_ADD(bytesAllocated, sizeof(TreapNode));
+      TreapNode *node = NodeAllocatorTraits::allocate(alloc, 1);
+      try {
+        NodeAllocatorTraits::construct(alloc, node, std::forward<Args>(args)...);
+      } catch (...) {
+        NodeAllocatorTraits::deallocate(alloc, node, 1);
+        throw;
+      }
+      return NodePtrType(node);
+    }
+
+    /**
+     * Called when the last reference to 'node' is dropped. Frees it
+     * (see destroyTree()), or hands it to TreapReclaimer if that is
+     * running.
+     */
+    static void destroy(TreapNode *node) {
+      if (!TreapReclaimer::instance().defer(node, &destroyErased)) {
+        destroyTree(node);
+      }
+    }
+
+    /**
+     * Free 'node', which has no references left, and every node
+     * below it that is referenced only through it. Works in O(1)
+     * space however deep the tree is: while the current node has an
+     * exclusively owned left child, that child is rotated up in its
+     * place. Otherwise the current node is freed and we continue
+     * with its right child.
+     */
+    static void destroyTree(TreapNode *node) {
+      while (node) {
+        TreapNode *l = node->left.detach();
+        if (l && l->refs.release()) {
+          node->left = NodePtrType::adopt(l->right.detach());
+          // 'node' is referenced by 'l' until we get back to it.
+          node->refs.acquire();
+          l->right = NodePtrType::adopt(node);
+          node = l;
+        } else {
+          TreapNode *r = node->right.detach();
+          if (r && !r->refs.release()) {
+            r = nullptr;
+          }
+          freeNode(node);
+          node = r;
+        }
+      }
+    }
+
+    static void destroyErased(void *node) {
+      destroyTree(static_cast<TreapNode*>(node));
+    }
+
+    /**
+     * Free just 'node', which must not have children.
+     */
+    static void freeNode(TreapNode *node) {
+      NodeAllocator alloc;
+      TREAP_STATS_ADD(nodesFreed, 1);
+      TREAP_STATS_ADD(bytesFreed, sizeof(TreapNode));
+      NodeAllocatorTraits::destroy(alloc, node);
+      NodeAllocatorTraits::deallocate(alloc, node, 1);
+    }
+
+    bool isLeftChildOf(NodePtrType const &parent) const {
+      return parent->left.get() == this;
+    }
+
+    bool isRightChildOf(NodePtrType const &parent) const {
+      return parent->right.get() == this;
+    }
+
+    bool isLeftChildOf(TreapNode const *parent) const {
+      return parent->left.get() == this;
+    }
+
+    bool isRightChildOf(TreapNode const *parent) const {
+      return parent->right.get() == this;
+    }
+
+    NodePtrType clone() const {
+      TREAP_STATS_ADD(clones, 1);
+      return create(this->data,
+                    this->heapKey,
+                    this->subtreeSize,
+                    this->left,
+                    this->right);
+    }
+
+    typename Summary::value_type computeSummary() const {
+      return Summary::combine(
+        Summary::combine(this->left ? this->left->summary() : Summary::identity(),
+                         Summary::lift(this->data)),
+        this->right ? this->right->summary() : Summary::identity());
+    }
+
+    /**
+     * Recompute 'subtreeSize' and 'summary' from the child
+     * subtrees. Must be called whenever the children or 'data'
+     * change.
+     *
+     * Throws std::length_error if the subtree holds more elements
+     * than 'size_type' can count. The nodes being built are then
+     * dropped, and existing versions are left untouched.
+     */
+    void update() {
+      const size_t size = size_t(this->left ? this->left->subtreeSize : 0) +
+        (this->right ? this->right->subtreeSize : 0) + 1;
+      if (size > std::numeric_limits<size_type>::max()) {
+        throw std::length_error("Treap: too many elements for the node layout");
+      }
+      this->subtreeSize = size;
+      this->setSummary(this->computeSummary());
+    }
+
+    /**
+     * Make 'node' safe to modify in place and return it. If 'node'
+     * is referenced from anywhere else, it is replaced by a clone.
+     *
+     * Note: Only valid if 'node' itself was reached through a chain
+     * of pointers owned exclusively by the caller.
+     */
+    static TreapNode* makeUnique(NodePtrType &node) {
+      if (node->refs.get() != 1) {
+        node = node->clone();
+      }
+      return node.get();
+    }
+  };
+
+  class RNGIterator : public std::iterator<std::forward_iterator_tag, const int> {
+    unsigned int seed;
+    int rno;
+
+  public:
+    RNGIterator (unsigned int seed_) : seed(seed_), rno(0) {
+      ++(*this);
+    }
+
+    RNGIterator& operator++() {
+      this->rno = rand_r(&this->seed);
+      return *this;
+    }
+
+    RNGIterator operator++(int) {
+      RNGIterator ret = *this;
+      ++(*this);
+      return ret;
+    }
+
+    int operator*() const {
+      return this->rno;
+    }
+
+  };
+
+  /**
+   * A fork-join pool of worker threads used by the parallel treap
+   * algorithms. Every worker has its own queue of tasks. A worker
+   * forking a task pushes it on to the back of its own queue, and
+   * idle workers steal tasks from the front of other queues. A thread
+   * waiting for a forked task to complete helps by running other
+   * queued tasks, so invoke() may be nested freely.
+   *
+   * With 0 worker threads (the default when TREAP_SINGLE_THREADED is
+   * defined), everything runs on the calling thread.
+   */
+  class TreapTaskPool {
+    struct Task {
+      void (*run)(void*);
+      void *arg;
+      std::atomic<bool> done;
+      std::exception_ptr error;
+
+      Task(void (*_run)(void*), void *_arg)
+        : run(_run), arg(_arg), done(false) { }
+    };
+
+    struct WorkQueue {
+      std::mutex mutex;
+      std::deque<Task*> tasks;
+    };
+
+    struct WorkerId {
+      TreapTaskPool const *pool;
+      size_t index;
+    };
+
+    std::vector<std::thread> threads;
+    // One queue per worker thread, followed by one shared by all
+    // threads that aren't workers of this pool.
+    std::vector<std::unique_ptr<WorkQueue> > queues;
+    std::atomic<size_t> queued;
+    std::mutex sleepMutex;
+    std::condition_variable wakeup;
+    bool stopping;
+
+    static WorkerId& currentWorker() {
+      static thread_local WorkerId id = { nullptr, 0 };
+      return id;
+    }
+
+    size_t queueIndex() const {
+      WorkerId const &id = currentWorker();
+      return id.pool == this ? id.index : this->threads.size();
+    }
+
+    template <typename Func>
+    static void runFunc(void *func) {
+      (*static_cast<Func const*>(func))();
+    }
+
+    static void execute(Task *task) {
+      try {
+        task->run(task->arg);
+      } catch (...) {
+        task->error = std::current_exception();
+      }
+      task->done.store(true, std::memory_order_release);
+    }
+
+    /**
+     * Pop a task from the back of queue 'self', or steal one from the
+     * front of any other queue.
+     */
+    Task* findTask(size_t self) {
+      for (size_t i = 0; i < this->queues.size(); ++i) {
+        WorkQueue &q = *this->queues[(self + i) % this->queues.size()];
+        std::lock_guard<std::mutex> lock(q.mutex);
+        if (q.tasks.empty()) continue;
+        Task *task;
+        if (i == 0) {
+          task = q.tasks.back();
+          q.tasks.pop_back();
+        } else {
+          task = q.tasks.front();
+          q.tasks.pop_front();
+        }
+        this->queued.fetch_sub(1);
+        return task;
+      }
+      return nullptr;
+    }
+
+    /**
+     * Remove 'task' from queue 'self' if nobody has stolen it yet.
+     */
+    bool reclaim(size_t self, Task *task) {
+      WorkQueue &q = *this->queues[self];
+      std::lock_guard<std::mutex> lock(q.mutex);
+      for (auto it = q.tasks.rbegin(); it != q.tasks.rend(); ++it) {
+        if (*it == task) {
+          q.tasks.erase(std::next(it).base());
+          this->queued.fetch_sub(1);
+          return true;
+        }
+      }
+      return false;
+    }
+
+    void workerLoop(size_t index) {
+      currentWorker().pool = this;
+      currentWorker().index = index;
+      while (true) {
+        Task *task = this->findTask(index);
+        if (task) {
+          execute(task);
+          continue;
+        }
+        std::unique_lock<std::mutex> lock(this->sleepMutex);
+        this->wakeup.wait(lock, [this] {
+            return this->stopping || this->queued.load() > 0;
+          });
+        if (this->stopping && this->queued.load() == 0) {
+          return;
+        }
+      }
+    }
+
+  public:
+    explicit TreapTaskPool(size_t numThreads)
+      : queued(0), stopping(false) {
+      for (size_t i = 0; i <= numThreads; ++i) {
+        this->queues.emplace_back(new WorkQueue);
+      }
+      for (size_t i = 0; i < numThreads; ++i) {
+        this->threads.emplace_back(&TreapTaskPool::workerLoop, this, i);
+      }
+    }
+
+    TreapTaskPool(TreapTaskPool const&) = delete;
+    TreapTaskPool& operator=(TreapTaskPool const&) = delete;
+
+    ~TreapTaskPool() {
+      {
+        std::lock_guard<std::mutex> lock(this->sleepMutex);
+        this->stopping = true;
+      }
+      this->wakeup.notify_all();
+      for (auto &thread : this->threads) {
+        thread.join();
+      }
+    }
+
+    /**
+     * The pool used by default. It has one worker thread less than
+     * the number of hardware threads, since the calling thread also
+     * participates.
+     */
+    static TreapTaskPool& instance() {
+#if defined TREAP_SINGLE_THREADED
+      static TreapTaskPool pool(0);
+#else
+      static TreapTaskPool pool(std::max(std::thread::hardware_concurrency(), 1u) - 1);
+#endif
+      return pool;
+    }
+
+    /**
+     * The number of threads that can run tasks concurrently,
+     * including the calling thread.
+     */
+    size_t concurrency() const {
+      return this->threads.size() + 1;
+    }
+
+    /**
+     * Run f() and g(), possibly in parallel, and return when both
+     * have completed. If either throws, the exception is re-thrown
+     * here (f's exception takes precedence).
+     */
+    template <typename F, typename G>
+    void invoke(F const &f, G const &g) {
+      if (this->threads.empty()) {
+        f();
+        g();
+        return;
+      }
+      const size_t self = this->queueIndex();
+      Task task(&runFunc<G>, const_cast<void*>(static_cast<void const*>(&g)));
+      {
+        WorkQueue &q = *this->queues[self];
+        std::lock_guard<std::mutex> lock(q.mutex);
+        q.tasks.push_back(&task);
+        this->queued.fetch_add(1);
+      }
+      {
+        std::lock_guard<std::mutex> lock(this->sleepMutex);
+      }
+      this->wakeup.notify_one();
+
+      std::exception_ptr error;
+      try {
+        f();
+      } catch (...) {
+        error = std::current_exception();
+      }
+
+      if (this->reclaim(self, &task)) {
+        execute(&task);
+      } else {
+        while (!task.done.load(std::memory_order_acquire)) {
+          Task *other = this->findTask(self);
+          if (other) {
+            execute(other);
+          } else {
+            std::this_thread::yield();
+          }
+        }
+      }
+      if (error) std::rethrow_exception(error);
+      if (task.error) std::rethrow_exception(task.error);
+    }
+  };
+
+  /**
+   * Stable sort [first, last) using 'pool'. Both halves of a range
+   * are sorted in parallel and then merged.
+   */
+  template <typename RandomIt, typename Compare>
+  void parallelStableSort(RandomIt first, RandomIt last, Compare const &comp,
+                          TreapTaskPool &pool) {
+    const size_t n = last - first;
+    if (n < _treap_parallel_grain || pool.concurrency() == 1) {
+      std::stable_sort(first, last, comp);
+      return;
+    }
+    RandomIt middle = first + n / 2;
+    pool.invoke([&]() { parallelStableSort(first, middle, comp, pool); },
+                [&]() { parallelStableSort(middle, last, comp, pool); });
+    std::inplace_merge(first, middle, last, comp);
+  }
+
+  /**
+   * A stack of raw node pointers, used to hold the root to node path
+   * in a TreapIterator. Up to 'InlineCapacity' pointers are stored
+   * inline, which is deeper than a treap of any practical size is
+   * likely to get. Only deeper paths (degenerate trees) spill over to
+   * the heap.
+   */
+  template <typename Node, size_t InlineCapacity = 64>
+  class TreapNodeStack {
+    Node *inlineNodes[InlineCapacity];
+    Node **nodes;
+    size_t count;
+    size_t capacity;
+
+    void reserve(size_t newCapacity) {
+      if (newCapacity <= this->capacity) return;
+      Node **newNodes = new Node*[newCapacity];
+      std::copy(this->nodes, this->nodes + this->count, newNodes);
+      this->release();
+      this->nodes = newNodes;
+      this->capacity = newCapacity;
+    }
+
+    void release() {
+      if (this->nodes != this->inlineNodes) {
+        delete[] this->nodes;
+      }
+      this->nodes = this->inlineNodes;
+      this->capacity = InlineCapacity;
+    }
+
+  public:
+    TreapNodeStack()
+      : nodes(inlineNodes), count(0), capacity(InlineCapacity) { }
+
+    TreapNodeStack(TreapNodeStack const &rhs)
+      : nodes(inlineNodes), count(0), capacity(InlineCapacity) {
+      *this = rhs;
+    }
+
+    TreapNodeStack(TreapNodeStack &&rhs)
+      : nodes(inlineNodes), count(0), capacity(InlineCapacity) {
+      *this = std::move(rhs);
+    }
+
+    ~TreapNodeStack() {
+      this->release();
+    }
+
+    TreapNodeStack& operator=(TreapNodeStack const &rhs) {
+      if (this == &rhs) return *this;
+      this->reserve(rhs.count);
+      std::copy(rhs.nodes, rhs.nodes + rhs.count, this->nodes);
+      this->count = rhs.count;
+      return *this;
+    }
+
+    TreapNodeStack& operator=(TreapNodeStack &&rhs) {
+      if (this == &rhs) return *this;
+      if (rhs.nodes == rhs.inlineNodes) {
+        return *this = static_cast<TreapNodeStack const&>(rhs);
+      }
+      this->release();
+      this->nodes = rhs.nodes;
+      this->count = rhs.count;
+      this->capacity = rhs.capacity;
+      rhs.nodes = rhs.inlineNodes;
+      rhs.count = 0;
+      rhs.capacity = InlineCapacity;
+      return *this;
+    }
+
+    void push_back(Node *node) {
+      if (this->count == this->capacity) {
+        this->reserve(this->capacity * 2);
+      }
+      this->nodes[this->count++] = node;
+    }
+
+    void pop_back() {
+      assert(this->count > 0);
+      --this->count;
+    }
+
+    /**
+     * Truncate to the first 'newSize' pointers.
+     */
+    void resize(size_t newSize) {
+      assert(newSize <= this->count);
+      this->count = newSize;
+    }
+
+    void clear() { this->count = 0; }
+    size_t size() const { return this->count; }
+    bool empty() const { return this->count == 0; }
+    Node* back() const { return this->nodes[this->count - 1]; }
+    Node* operator[](size_t idx) const { return this->nodes[idx]; }
+  };
+
+  template <typename T, typename LessThan=std::less<T>,
+            typename NodeType=TreapNode<T> >
+  class TreapIterator : public std::iterator<std::random_access_iterator_tag, const T> {
+    typedef TreapNodeStack<NodeType const> PtrsType;
+    // 'ptrs' stores all node pointers from root up to the current
+    // node, following both the left and right children. It doesn't
+    // matter which child we follow since finding the successor
+    // [operator++] or the predecessor [operator--] can be done
+    // entirely by looking at the current node and the path from the
+    // root to this node, all of which are stored in 'ptrs'.
+    //
+    // Storing 'ptrs' allows us to achieve amortized O(1) cost of
+    // iterating over the whole collection. If we re-computed the path
+    // from the root to the current node every time we wanted to visit
+    // the parent node, we would have to incur a cost of O(n log n) to
+    // iterate over the entire collection.
+    //
+    // The iterator doesn't own any nodes (it holds raw pointers, so
+    // creating and copying it costs no allocations or reference
+    // count updates). It borrows them from the treap that it was
+    // obtained from, which must be kept alive for as long as the
+    // iterator is in use.
+    //
+    PtrsType ptrs;
+    NodeType const *root;
+    template <typename, typename, typename, typename, typename, typename>
+    friend class Treap;
+
+    /**
+     * Returns the current state of the iterator. i.e. The path from
+     * the root node to the current node.
+     */
+    PtrsType const& getRootToNodePtrs() const {
+      return this->ptrs;
+    }
+
+    /**
+     * Returns the rank of the iterator '*this'. i.e. It returns the
+     * number of elements < the element pointed to by '*this'.
+     */
+    size_t rank() const {
+      if (!this->root) return 0;
+      if (this->ptrs.empty()) {
+        /* This is the end() iterator */
+        return this->root->subtreeSize;
+      }
+
+      /* Stores the # of elements >= *this.
+       *
+       * At every step of the for loop, 'count' stores the number of
+       * nodes >= ptrs[i] plus the count of the elements under the
+       * left child of ptrs[i]. To compensate for the excess
+       * (left-child counts), we subtract this value right at the end.
+       *
+       */
+      size_t count = 0;
+      count = ptrs[0]->subtreeSize;
+      for (size_t i = 1; i < ptrs.size(); ++i) {
+        if (ptrs[i]->isRightChildOf(ptrs[i-1])) {
+          // Everything to the right is kosher.
+          count -= ptrs[i-1]->subtreeSize;
+          count += ptrs[i]->subtreeSize;
+        }
+      }
+      count -= (ptrs.back()->left ? ptrs.back()->left->subtreeSize : 0);
+      // Return # of elements < *this
+      return root->subtreeSize - count;
+    }
+
+    /**
+     * Moves the current iterator to point to the rank'th
+     * element. Ranks start from 0. The k'th element is the k'th
+     * smallest element in the treap.
+     */
+    void moveToRank(const size_t rank) {
+      assert(rank > 0 && this->root || rank == 0);
+      if (!this->root) return;
+      assert(rank <= this->root->subtreeSize);
+      if (rank == this->root->subtreeSize) {
+        // Move to end()
+        this->ptrs.clear();
+        return;
+      }
+      this->ptrs.clear();
+      this->ptrs.push_back(this->root);
+      size_t currRank = this->root->left ? this->root->left->subtreeSize : 0;
+      while (currRank != rank) {
+        if (currRank < rank) {
+          this->ptrs.push_back(this->ptrs.back()->right.get());
+          currRank += 1;
+        } else {
+          this->ptrs.push_back(this->ptrs.back()->left.get());
+          currRank -= this->ptrs.back()->subtreeSize;
+        }
+        currRank += this->ptrs.back()->left ? this->ptrs.back()->left->subtreeSize : 0;
+      }
+    }
+
+  public:
+    TreapIterator() : root(nullptr) { }
+    TreapIterator(PtrsType &&_ptrs, NodeType const *_root)
+      : ptrs(std::move(_ptrs)), root(_root) { }
+
+    TreapIterator& operator++() {
+      assert(!ptrs.empty());
+      auto tmp = ptrs.back();
+      if (tmp->right.get()) {
+        tmp = tmp->right.get();
+        ptrs.push_back(tmp);
+        while (tmp->left.get()) {
+          tmp = tmp->left.get();
+          ptrs.push_back(tmp);
+        }
+        return *this;
+      }
+      if (ptrs.size() > 1) {
+        size_t ptrx = ptrs.size() - 1;
+        // Right-Child
+        while (ptrs.size() > 1 && ptrs[ptrx]->isRightChildOf(ptrs[ptrx - 1])) {
+          --ptrx;
+          ptrs.pop_back();
+        }
+        if (ptrs.size() > 1 && ptrs[ptrx]->isLeftChildOf(ptrs[ptrx - 1])) {
+          ptrs.pop_back();
+          return *this;
+        }
+      }
+      assert(ptrs.size() == 1);
+      // Clean-up since ptrs.size() == 1
+      ptrs.pop_back();
+      return *this;
+    }
+
+    TreapIterator operator++(int) {
+      TreapIterator it = *this;
+      ++*this;
+      return it;
+    }
+
+    TreapIterator& operator--() {
+      if (ptrs.empty()) {
+        auto tmp = this->root;
+        while (tmp) {
+          ptrs.push_back(tmp);
+          tmp = tmp->right.get();
+        }
+        return *this;
+      }
+
+      auto tmp = ptrs.back();
+      if (tmp->left.get()) {
+        tmp = tmp->left.get();
+        ptrs.push_back(tmp);
+        while (tmp->right.get()) {
+          tmp = tmp->right.get();
+          ptrs.push_back(tmp);
+        }
+        return *this;
+      }
+      if (ptrs.size() > 1) {
+        size_t ptrx = ptrs.size() - 1;
+        // Right-Child
+        while (ptrs.size() > 1 && ptrs[ptrx]->isLeftChildOf(ptrs[ptrx - 1])) {
+          --ptrx;
+          ptrs.pop_back();
+        }
+        if (ptrs.size() > 1 && ptrs[ptrx]->isRightChildOf(ptrs[ptrx - 1])) {
+          ptrs.pop_back();
+          return *this;
+        }
+      }
+      // We backed up all the way before the first node. This is an
+      // error.
+      assert(ptrs.size() != 1);
+      return *this;
+    }
+
+    TreapIterator operator--(int) {
+      TreapIterator it = *this;
+      --*this;
+      return it;
+    }
+
+    TreapIterator& operator+=(const off_t offset) {
+      this->moveToRank(static_cast<off_t>(this->rank()) + offset);
+      return *this;
+    }
+
+    TreapIterator& operator-=(const off_t offset) {
+      this->moveToRank(static_cast<off_t>(this->rank()) - offset);
+      return *this;
+    }
+
+    TreapIterator operator+(const off_t offset) const {
+      TreapIterator it = *this;
+      it += offset;
+      return it;
+    }
+
+    TreapIterator operator-(const off_t offset) const {
+      TreapIterator it = *this;
+      it -= offset;
+      return it;
+    }
+
+    /**
+     * Cost: O(log n)
+     */
+    off_t operator-(TreapIterator const& other) const {
+      const off_t otherRank = other.rank();
+      const off_t thisRank = this->rank();
+      return thisRank - otherRank;
+    }
+
+    T const& operator[](off_t offset) const {
+      if (offset == 0) return **this;
+      auto other = *this;
+      other += offset;
+      return *other;
     }
 
     T const& operator*() const {
       return ptrs.back()->data;
     }
 
-    const T* operator->() const {
-      return &(ptrs.back()->data);
+    const T* operator->() const {
+      return &(ptrs.back()->data);
+    }
+
+    /**
+     * Cost: O(1). Since the path from the root to a node is unique,
+     * comparing the current nodes is sufficient.
+     */
+    bool operator==(TreapIterator const &rhs) const {
+      return this->root == rhs.root &&
+        (this->ptrs.empty() ? nullptr : this->ptrs.back()) ==
+        (rhs.ptrs.empty() ? nullptr : rhs.ptrs.back());
+    }
+
+    bool operator!=(TreapIterator const &rhs) const {
+      return !(*this == rhs);
+    }
+
+  };
+
+  /**
+   * A number of treap nodes, and the bytes they occupy. Memory owned
+   * by the elements themselves (e.g. the buffer of a std::string) is
+   * not included.
+   */
+  struct TreapMemoryUsage {
+    size_t nodes;
+    size_t bytes;
+  };
+
+  /**
+   * Memory held by one version of a treap, relative to a set of
+   * versions (see Treap::memory_report()).
+   *
+   * total = shared + exclusive.
+   */
+  struct TreapVersionMemory {
+    // All nodes reachable from this version.
+    TreapMemoryUsage total;
+    // Nodes also reachable from some other version in the set.
+    TreapMemoryUsage shared;
+    // Nodes reachable only from this version.
+    TreapMemoryUsage exclusive;
+  };
+
+  /**
+   * The shape of a treap (see Treap::depth_stats()). Depths are
+   * counted in edges from the root.
+   */
+  struct TreapDepthStats {
+    size_t nodes;
+    // Depth of the deepest node.
+    size_t height;
+    double averageDepth;
+    // Average depth of the nodes of a treap of the same size with
+    // random priorities: 2 (1 + 1/n) H(n) - 4, about 2 ln(n) - 2.85.
+    double expectedAverageDepth;
+  };
+
+  /**
+   * Snapshot file format (see Treap::save()). All integers are in
+   * the byte order of the machine that wrote the snapshot; loading
+   * rejects snapshots written with a different byte order or record
+   * size.
+   *
+   * The header is followed (at offset sizeof(TreapSnapshotHeader))
+   * by 'count' records, one per node, in sorted order, so the record
+   * at index i holds the element of rank i. Children are referenced
+   * by record index, which makes the layout position independent.
+   */
+  struct TreapSnapshotHeader {
+    static const uint64_t NONE = ~uint64_t(0);
+
+    char magic[8];
+    uint32_t byteOrder;
+    uint32_t recordSize;
+    uint64_t count;
+    // Index of the root record, or NONE if empty.
+    uint64_t root;
+
+    static char const* expectedMagic() { return "TREAPSN1"; }
+    static uint32_t expectedByteOrder() { return 0x01020304; }
+
+    bool valid(uint32_t expectedRecordSize) const {
+      return memcmp(this->magic, expectedMagic(), sizeof(this->magic)) == 0 &&
+        this->byteOrder == expectedByteOrder() &&
+        this->recordSize == expectedRecordSize &&
+        (this->count == 0 ? this->root == NONE : this->root < this->count);
+    }
+  };
+
+  template <typename T>
+  struct TreapSnapshotRecord {
+    T data;
+    int32_t heapKey;
+    uint64_t subtreeSize;
+    // Record indexes of the children, or TreapSnapshotHeader::NONE.
+    uint64_t left, right;
+  };
+
+  /**
+   * Delta log format (see TreapDeltaWriter). Every node written to a
+   * log has an ID: the nodes of the base snapshot are numbered by
+   * record index, and every node written by a later delta gets the
+   * next unused ID.
+   *
+   * The header is followed by 'count' records for the nodes created
+   * since the previous delta, children before parents, and then by
+   * 'dropped' IDs (uint64_t) of the nodes that are no longer
+   * reachable from the new version. Byte order and record size are
+   * checked as for snapshots.
+   */
+  struct TreapDeltaHeader {
+    char magic[8];
+    uint32_t byteOrder;
+    uint32_t recordSize;
+    // Deltas are numbered from 0 and must be applied in order.
+    uint64_t sequence;
+    uint64_t count;
+    uint64_t dropped;
+    // ID of the root node, or TreapSnapshotHeader::NONE if empty.
+    uint64_t root;
+    // Number of elements of the new version.
+    uint64_t size;
+
+    static char const* expectedMagic() { return "TREAPDL1"; }
+
+    bool valid(uint32_t expectedRecordSize) const {
+      return memcmp(this->magic, expectedMagic(), sizeof(this->magic)) == 0 &&
+        this->byteOrder == TreapSnapshotHeader::expectedByteOrder() &&
+        this->recordSize == expectedRecordSize &&
+        (this->size == 0) == (this->root == TreapSnapshotHeader::NONE);
+    }
+  };
+
+  template <typename T>
+  struct TreapDeltaRecord {
+    T data;
+    int32_t heapKey;
+    uint64_t id;
+    // IDs of the children, or TreapSnapshotHeader::NONE.
+    uint64_t left, right;
+  };
+
+  /**
+   * This is an implementation of a functional treap data
+   * structure. Every mutating operation (insert/delete/update)
+   * doesn't mutate the existing treap, but instead returns a new copy
+   * of the treap, with the mutation applied. This means that every
+   * mutating operation on a treap *must* capture the return value
+   * since that is the latest version of the treap.
+   *
+   * Since no existing version is mutated, it is entirely safe to
+   * perform operations concurrently on your copy of the treap from
+   * multiple threads. A treap internally holds a reference counted
+   * pointer (TreapNodePtr<>) to the root node. This automatically
+   * reclaims memory for unused (past) versions of the treap, so
+   * memory management isn't an issue.
+   *
+   * This treap also provides _random access iterators_ (you heard
+   * that right!) that cost O(log n) per random
+   * increment/decrement. Incrementing using operator++/-- is O(1)
+   * amortized, but incrementing/decrementing by 1 using operator+=/-=
+   * is not (and costs O(log n) per increment/decrement). This is a
+   * design decision. Using the random access iterator, you can
+   * (quickly) perform operations like computing the number of
+   * elements between 2 given iterators. Iterators borrow the nodes
+   * of the treap that they were obtained from, which must outlive
+   * them.
+   *
+   * Nodes are allocated using 'Alloc' (rebound to the node type).
+   * Use TreapPoolAllocator<T> to recycle the nodes freed by dropped
+   * versions for subsequent path copies.
+   *
+   */
+  template <typename T, typename LessThan=std::less<T>,
+            typename Alloc=std::allocator<T>,
+            typename Summary=TreapNoSummary,
+            typename Layout=TreapDefaultLayout,
+            typename Priority=TreapRandomPriority>
+  class Treap {
+    typedef TreapNode<T, Alloc, Summary, Layout> NodeType;
+    typedef TreapCountingCompare<LessThan> KeyCompare;
+    typedef typename NodeType::NodePtrType NodePtrType;
+    mutable NodePtrType root;
+
+  public:
+    typedef TreapIterator<T, LessThan, NodeType> iterator;
+    typedef TreapIterator<T, LessThan, NodeType> const_iterator;
+    typedef T value_type;
+    typedef typename Summary::value_type summary_type;
+
+  private:
+    /**
+     * Visits the nodes reachable from 'node', skipping the subtree of
+     * every node for which visit(node) returns false.
+     */
+    template <typename Func>
+    static void walkNodes(NodeType const *node, Func visit) {
+      std::vector<NodeType const*> pending;
+      if (node) pending.push_back(node);
+      while (!pending.empty()) {
+        NodeType const *n = pending.back();
+        pending.pop_back();
+        if (!visit(n)) continue;
+        if (n->left) pending.push_back(n->left.get());
+        if (n->right) pending.push_back(n->right.get());
+      }
+    }
+
+    /**
+     * Summary of the elements of the subtree rooted at 'node' with
+     * rank in [first, last). Only descends along the 2 boundaries of
+     * the range; every subtree in between contributes its stored
+     * summary.
+     *
+     * Cost: O(log n)
+     */
+    static summary_type summarizeRange(NodeType const *node, size_t first, size_t last) {
+      if (!node || first >= last) {
+        return Summary::identity();
+      }
+      if (first == 0 && last >= node->subtreeSize) {
+        return node->summary();
+      }
+      const size_t leftSize = node->left ? node->left->subtreeSize : 0;
+      summary_type result = Summary::identity();
+      if (first < leftSize) {
+        result = summarizeRange(node->left.get(), first, std::min(last, leftSize));
+      }
+      if (first <= leftSize && leftSize < last) {
+        result = Summary::combine(result, Summary::lift(node->data));
+      }
+      if (last > leftSize + 1) {
+        const size_t rightFirst = first > leftSize + 1 ? first - leftSize - 1 : 0;
+        result = Summary::combine(result,
+                                  summarizeRange(node->right.get(), rightFirst,
+                                                 last - leftSize - 1));
+      }
+      return result;
+    }
+
+    typedef TreapSnapshotRecord<T> SnapshotRecord;
+
+    /**
+     * Pass the snapshot of this treap to write(data, size) in
+     * consecutive pieces. Returns false as soon as write() does.
+     */
+    template <typename Write>
+    bool writeSnapshot(Write write) const {
+      static_assert(std::is_trivially_copyable<T>::value,
+                    "Only treaps of trivially copyable elements can be saved");
+      const uint64_t NONE = TreapSnapshotHeader::NONE;
+      TreapSnapshotHeader header;
+      memset(&header, 0, sizeof(header));
+      memcpy(header.magic, TreapSnapshotHeader::expectedMagic(), sizeof(header.magic));
+      header.byteOrder = TreapSnapshotHeader::expectedByteOrder();
+      header.recordSize = sizeof(SnapshotRecord);
+      header.count = this->size();
+      header.root = this->root ? (this->root->left ? this->root->left->subtreeSize : 0) : NONE;
+      if (!write(&header, sizeof(header))) return false;
+
+      // In-order traversal. Every node on the stack is paired with
+      // the rank of the first element of its subtree.
+      std::vector<std::pair<NodeType const*, uint64_t> > stack;
+      auto pushLeftSpine = [&stack](NodeType const *n, uint64_t offset) {
+        for (; n; n = n->left.get()) {
+          stack.push_back(std::make_pair(n, offset));
+        }
+      };
+      auto sizeOf = [](NodePtrType const &n) -> uint64_t {
+        return n ? n->subtreeSize : 0;
+      };
+      std::vector<SnapshotRecord> buffer;
+      buffer.reserve(std::min<size_t>(this->size(), 4096));
+      pushLeftSpine(this->root.get(), 0);
+      while (!stack.empty()) {
+        NodeType const *n = stack.back().first;
+        const uint64_t offset = stack.back().second;
+        stack.pop_back();
+        const uint64_t rank = offset + sizeOf(n->left);
+
+        buffer.resize(buffer.size() + 1);
+        SnapshotRecord &record = buffer.back();
+        memset(&record, 0, sizeof(record));
+        memcpy(&record.data, &n->data, sizeof(T));
+        record.heapKey = n->heapKey;
+        record.subtreeSize = n->subtreeSize;
+        record.left = n->left ? offset + sizeOf(n->left->left) : NONE;
+        record.right = n->right ? rank + 1 + sizeOf(n->right->left) : NONE;
+        if (buffer.size() == buffer.capacity()) {
+          if (!write(buffer.data(), buffer.size() * sizeof(SnapshotRecord))) return false;
+          buffer.clear();
+        }
+        pushLeftSpine(n->right.get(), rank + 1);
+      }
+      return buffer.empty() ||
+        write(buffer.data(), buffer.size() * sizeof(SnapshotRecord));
+    }
+
+    /**
+     * Rebuild the tree saved in 'records' with the same shape and
+     * heap keys. Returns false if the records don't form a valid
+     * tree. Snapshots are trusted: the order of the elements isn't
+     * checked. If 'byIndex' is given, it is filled with the node
+     * built from each record.
+     *
+     * Cost: O(n)
+     */
+    static bool buildFromRecords(SnapshotRecord const *records,
+                                 TreapSnapshotHeader const &header,
+                                 NodePtrType &result,
+                                 std::vector<NodePtrType> *byIndex = nullptr) {
+      const uint64_t NONE = TreapSnapshotHeader::NONE;
+      result = nullptr;
+      if (byIndex) byIndex->assign(header.count, NodePtrType());
+      if (header.count == 0) return true;
+      // Post-order traversal. 'built' holds the roots of the
+      // completed subtrees.
+      std::vector<std::pair<uint64_t, bool> > stack;
+      std::vector<NodePtrType> built;
+      uint64_t visited = 0;
+      stack.push_back(std::make_pair(header.root, false));
+      while (!stack.empty()) {
+        const uint64_t idx = stack.back().first;
+        SnapshotRecord const &record = records[idx];
+        if (!stack.back().second) {
+          if (++visited > header.count) return false;
+          stack.back().second = true;
+          if (record.right != NONE) {
+            if (record.right >= header.count) return false;
+            stack.push_back(std::make_pair(record.right, false));
+          }
+          if (record.left != NONE) {
+            if (record.left >= header.count) return false;
+            stack.push_back(std::make_pair(record.left, false));
+          }
+          continue;
+        }
+        stack.pop_back();
+        NodePtrType right, left;
+        if (record.right != NONE) {
+          right = std::move(built.back());
+          built.pop_back();
+        }
+        if (record.left != NONE) {
+          left = std::move(built.back());
+          built.pop_back();
+        }
+        NodePtrType node = NodeType::create(record.data, record.heapKey, 1,
+                                            std::move(left), std::move(right));
+        node->update();
+        if (node->subtreeSize != record.subtreeSize) return false;
+        if (byIndex) (*byIndex)[idx] = node;
+        built.push_back(std::move(node));
+      }
+      if (visited != header.count) return false;
+      result = std::move(built.back());
+      return true;
+    }
+
+    static TreapMemoryUsage memoryUsage(size_t nodes) {
+      TreapMemoryUsage usage = { nodes, nodes * sizeof(NodeType) };
+      return usage;
+    }
+
+    /**
+     * Inserts a new node 'node' into the tree rooted at 'n', and
+     * returns a pointer to the new root. The existing tree is
+     * un-modified. The descent stops at the first node that 'node'
+     * has priority over (or at an empty child), and the subtree there
+     * is split by key into the children of 'node', so no rotations
+     * are needed. Only the nodes above the insertion point and those
+     * along the split are copied, and unchanged subtrees are shared
+     * between the older and the newer tree.
+     *
+     * 'node' goes after every element for which goesBefore(element)
+     * is true, and before the rest. 'goesBefore' must be true for a
+     * prefix of the elements in sorted order.
+     *
+     * Cost: O(log n)
+     */
+    template <typename Pred>
+    static NodePtrType insertNode(NodePtrType const &n, NodePtrType &node,
+                                  Pred const &goesBefore) {
+      if (!n || node->heapKey < n->heapKey) {
+        splitNode(n, goesBefore, node->left, node->right);
+        node->update();
+        return node;
+      }
+      TREAP_STATS_ADD(pathNodes, 1);
+      NodePtrType copy = n->clone();
+      if (goesBefore(n->data)) {
+        copy->right = insertNode(n->right, node, goesBefore);
+      } else {
+        copy->left = insertNode(n->left, node, goesBefore);
+      }
+      copy->update();
+      return copy;
+    }
+
+    /**
+     * Same as above, with 'node' going after every element equal to
+     * it (at the upper bound).
+     */
+    static NodePtrType insertNode(NodePtrType const &n, NodePtrType &node) {
+      KeyCompare lt;
+      T const &data = node->data;
+      return insertNode(n, node, [&lt, &data](T const &elem) { return !lt(data, elem); });
+    }
+
+    /**
+     * Return a new root in which the subtree under path[depth] of the
+     * tree rooted at path[0] is replaced by 'subtree'. 'path' holds a
+     * root to node path, and path[0 .. depth) is copied.
+     */
+    template <typename Path>
+    static NodePtrType replaceAtPath(Path const &path, size_t depth,
+                                     NodePtrType subtree) {
+      for (size_t i = depth; i > 0; --i) {
+        NodePtrType copy = path[i - 1]->clone();
+        if (path[i]->isLeftChildOf(path[i - 1])) {
+          copy->left = std::move(subtree);
+        } else {
+          copy->right = std::move(subtree);
+        }
+        copy->update();
+        subtree = std::move(copy);
+      }
+      return subtree;
+    }
+
+    /**
+     * Inserts 'node' into the tree rooted at 'n' so that it has
+     * 'rank' elements of that tree before it, without comparing any
+     * keys, and returns the new root. The descent stops at the first
+     * node that 'node' has priority over, and the subtree there is
+     * split by rank into the children of 'node'. The caller must make
+     * sure that this keeps the elements in sorted order.
+     *
+     * Cost: O(log n)
+     */
+    static NodePtrType insertNodeAt(NodePtrType const &n, NodePtrType &node, size_t rank) {
+      if (!n || node->heapKey < n->heapKey) {
+        splitNodeAt(n, rank, node->left, node->right);
+        node->update();
+        return node;
+      }
+      TREAP_STATS_ADD(pathNodes, 1);
+      const size_t leftSize = n->left ? n->left->subtreeSize : 0;
+      NodePtrType copy = n->clone();
+      if (rank <= leftSize) {
+        copy->left = insertNodeAt(n->left, node, rank);
+      } else {
+        copy->right = insertNodeAt(n->right, node, rank - leftSize - 1);
+      }
+      copy->update();
+      return copy;
+    }
+
+    /**
+     * Clone the path present in 'ptrs' and return a list of cloned
+     * nodes with their left and right pointers set to the new nodes
+     * (if appropriate).
+     *
+     */
+    std::vector<NodePtrType>
+    clonePtrs(typename iterator::PtrsType const &ptrs) const {
+      std::vector<NodePtrType> clonedPtrs;
+      assert(!ptrs.empty());
+      clonedPtrs.reserve(ptrs.size());
+      TREAP_STATS_ADD(pathNodes, ptrs.size());
+      clonedPtrs.push_back(ptrs[0]->clone());
+      for (size_t i = 1; i < ptrs.size(); ++i) {
+        clonedPtrs.push_back(ptrs[i]->clone());
+        if (ptrs[i]->isLeftChildOf(ptrs[i-1])) {
+          clonedPtrs[i-1]->left = clonedPtrs[i];
+        } else {
+          clonedPtrs[i-1]->right = clonedPtrs[i];
+        }
+      }
+      return clonedPtrs;
+    }
+
+    /**
+     * Erase the first element equal to 'key' from the tree rooted at
+     * 'n' in a single descent, and store the new root in
+     * 'result'. The children of the erased node are joined by
+     * priority, so only its ancestors and the nodes along the seam of
+     * the join are copied. Returns false (and leaves 'result'
+     * untouched, copying nothing) if there is no such element.
+     *
+     * Cost: O(log n)
+     */
+    static bool eraseNode(NodePtrType const &n, T const &key, NodePtrType &result) {
+      if (!n) {
+        return false;
+      }
+      TREAP_STATS_ADD(pathNodes, 1);
+      KeyCompare lt;
+      NodePtrType child;
+      if (lt(n->data, key)) {
+        if (!eraseNode(n->right, key, child)) return false;
+        NodePtrType copy = n->clone();
+        copy->right = std::move(child);
+        copy->update();
+        result = std::move(copy);
+        return true;
+      }
+      // n->data >= key: the first equal element is either on the
+      // left or 'n' itself.
+      if (eraseNode(n->left, key, child)) {
+        NodePtrType copy = n->clone();
+        copy->left = std::move(child);
+        copy->update();
+        result = std::move(copy);
+        return true;
+      }
+      if (lt(key, n->data)) {
+        return false;
+      }
+      result = joinNodes(n->left, n->right);
+      return true;
+    }
+
+    /**
+     * Erase the element that 'it' points to and return the new
+     * root. Copies the path above it and joins its children.
+     */
+    NodePtrType deleteIterator(iterator const &it) const {
+      auto const &ptrs = it.getRootToNodePtrs();
+      assert(!ptrs.empty());
+      TREAP_STATS_ADD(pathNodes, ptrs.size());
+      NodeType const *node = ptrs.back();
+      return replaceAtPath(ptrs, ptrs.size() - 1, joinNodes(node->left, node->right));
+    }
+
+    /**
+     * Split the tree rooted at 'node' into 'lhs' and 'rhs' such that
+     * 'lhs' contains every element for which goesLeft(element) is
+     * true. 'goesLeft' must be true for a prefix of the elements in
+     * sorted order. Only the nodes on the path along which the split
+     * happens are copied, and subtrees that end up entirely on one
+     * side are shared with 'node'.
+     *
+     * Note: 'lhs' and 'rhs' must not alias 'node'.
+     *
+     * Cost: O(log n)
+     */
+    template <typename Pred>
+    static void splitNode(NodePtrType const &node, Pred const &goesLeft,
+                          NodePtrType &lhs, NodePtrType &rhs) {
+      if (!node) {
+        lhs = rhs = nullptr;
+        return;
+      }
+      NodePtrType part;
+      if (goesLeft(node->data)) {
+        splitNode(node->right, goesLeft, part, rhs);
+        if (part == node->right) {
+          lhs = node;
+          return;
+        }
+        NodePtrType n = node->clone();
+        n->right = std::move(part);
+        n->update();
+        lhs = std::move(n);
+      } else {
+        splitNode(node->left, goesLeft, lhs, part);
+        if (part == node->left) {
+          rhs = node;
+          return;
+        }
+        NodePtrType n = node->clone();
+        n->left = std::move(part);
+        n->update();
+        rhs = std::move(n);
+      }
+    }
+
+    /**
+     * Split the tree rooted at 'node' into 'lhs' containing the first
+     * 'rank' elements and 'rhs' containing the rest.
+     *
+     * Note: 'lhs' and 'rhs' must not alias 'node'.
+     *
+     * Cost: O(log n)
+     */
+    static void splitNodeAt(NodePtrType const &node, size_t rank,
+                            NodePtrType &lhs, NodePtrType &rhs) {
+      if (!node || rank == 0) {
+        lhs = nullptr;
+        rhs = node;
+        return;
+      }
+      if (rank >= node->subtreeSize) {
+        lhs = node;
+        rhs = nullptr;
+        return;
+      }
+      const size_t leftSize = node->left ? node->left->subtreeSize : 0;
+      NodePtrType n = node->clone();
+      if (rank <= leftSize) {
+        splitNodeAt(node->left, rank, lhs, n->left);
+        n->update();
+        rhs = std::move(n);
+      } else {
+        splitNodeAt(node->right, rank - leftSize - 1, n->right, rhs);
+        n->update();
+        lhs = std::move(n);
+      }
+    }
+
+    /**
+     * The number of elements in the subtree rooted at 'n' for which
+     * goesLeft(element) is true, where 'goesLeft' is true for a prefix
+     * of the elements in sorted order.
+     *
+     * Cost: O(log n)
+     */
+    template <typename Pred>
+    static size_t countPrefix(NodeType const *n, Pred const &goesLeft) {
+      size_t count = 0;
+      while (n) {
+        TREAP_STATS_ADD(pathNodes, 1);
+        if (goesLeft(n->data)) {
+          count += (n->left ? n->left->subtreeSize : 0) + 1;
+          n = n->right.get();
+        } else {
+          n = n->left.get();
+        }
+      }
+      return count;
+    }
+
+    /**
+     * The number of elements for which belowLo(element) is false and
+     * belowHi(element) is true, where both are true for a prefix of
+     * the elements (that of 'belowLo' being no longer). Descends
+     * until the 2 boundaries part ways, and then along each of them.
+     *
+     * Cost: O(log n)
+     */
+    template <typename PredLo, typename PredHi>
+    static size_t countBetween(NodeType const *n, PredLo const &belowLo,
+                               PredHi const &belowHi) {
+      while (n) {
+        TREAP_STATS_ADD(pathNodes, 1);
+        if (belowLo(n->data)) {
+          n = n->right.get();
+        } else if (!belowHi(n->data)) {
+          n = n->left.get();
+        } else {
+          // 'n' is in the range. Count the elements of its left
+          // subtree at or above 'lo' and of its right subtree below
+          // 'hi'.
+          const size_t leftSize = n->left ? n->left->subtreeSize : 0;
+          return 1 + leftSize - countPrefix(n->left.get(), belowLo) +
+            countPrefix(n->right.get(), belowHi);
+        }
+      }
+      return 0;
+    }
+
+    /**
+     * Split the tree rooted at 'node' into the elements < lo, those
+     * in [lo, hi), and those >= hi.
+     *
+     * Cost: O(log n)
+     */
+    static void splitRange(NodePtrType const &node, T const &lo, T const &hi,
+                           NodePtrType &lhs, NodePtrType &middle, NodePtrType &rhs) {
+      KeyCompare lt;
+      NodePtrType rest;
+      splitNode(node, [&lt, &lo](T const &data) { return lt(data, lo); }, lhs, rest);
+      splitNode(rest, [&lt, &hi](T const &data) { return lt(data, hi); }, middle, rhs);
+    }
+
+    /**
+     * Join the trees rooted at 'lhs' and 'rhs' where every element in
+     * 'lhs' is <= every element in 'rhs', and return the new
+     * root. Only the nodes on the right spine of 'lhs' and the left
+     * spine of 'rhs' that end up above the seam are copied.
+     *
+     * Cost: O(log n)
+     */
+    static NodePtrType joinNodes(NodePtrType const &lhs, NodePtrType const &rhs) {
+      if (!lhs) return rhs;
+      if (!rhs) return lhs;
+      if (lhs->heapKey <= rhs->heapKey) {
+        NodePtrType n = lhs->clone();
+        n->right = joinNodes(lhs->right, rhs);
+        n->update();
+        return n;
+      }
+      NodePtrType n = rhs->clone();
+      n->left = joinNodes(lhs, rhs->left);
+      n->update();
+      return n;
+    }
+
+    /*
+     * The *Owned() functions below take their input subtrees by value
+     * and modify any node that they hold the only reference to in
+     * place; all other nodes are copied before being modified. Since
+     * a node created during an operation is referenced only by that
+     * operation, this ensures that each node is copied at most once
+     * per operation, and that no other version is affected.
+     */
+
+    /**
+     * Same as splitNode(), but modifies exclusively owned nodes in
+     * place.
+     */
+    template <typename Pred>
+    static void splitOwned(NodePtrType node, Pred const &goesLeft,
+                           NodePtrType &lhs, NodePtrType &rhs) {
+      if (!node || node->refs.get() != 1) {
+        splitNode(node, goesLeft, lhs, rhs);
+        return;
+      }
+      NodePtrType part;
+      if (goesLeft(node->data)) {
+        splitOwned(std::move(node->right), goesLeft, part, rhs);
+        node->right = std::move(part);
+        node->update();
+        lhs = std::move(node);
+      } else {
+        splitOwned(std::move(node->left), goesLeft, lhs, part);
+        node->left = std::move(part);
+        node->update();
+        rhs = std::move(node);
+      }
+    }
+
+    /**
+     * Same as joinNodes(), but modifies exclusively owned nodes in
+     * place.
+     */
+    static NodePtrType joinOwned(NodePtrType lhs, NodePtrType rhs) {
+      if (!lhs) return rhs;
+      if (!rhs) return lhs;
+      if (lhs->heapKey <= rhs->heapKey) {
+        NodeType *n = NodeType::makeUnique(lhs);
+        n->right = joinOwned(std::move(n->right), std::move(rhs));
+        n->update();
+        return lhs;
+      }
+      NodeType *n = NodeType::makeUnique(rhs);
+      n->left = joinOwned(std::move(lhs), std::move(n->left));
+      n->update();
+      return rhs;
+    }
+
+    /**
+     * Merge the trees rooted at 'lhs' and 'rhs' into one tree
+     * containing the elements of both. Elements of 'lhs' are placed
+     * before elements of 'rhs' that compare equal to them.
+     *
+     * Cost: O(m log(n/m + 1)) where m <= n are the sizes of the
+     * inputs.
+     */
+    static NodePtrType mergeOwned(NodePtrType lhs, NodePtrType rhs) {
+      if (!lhs) return rhs;
+      if (!rhs) return lhs;
+      KeyCompare lt;
+      if (lhs->heapKey <= rhs->heapKey) {
+        NodeType *n = NodeType::makeUnique(lhs);
+        T const &key = n->data;
+        NodePtrType less, rest;
+        splitOwned(std::move(rhs), [&lt, &key](T const &data) { return lt(data, key); },
+                   less, rest);
+        n->left = mergeOwned(std::move(n->left), std::move(less));
+        n->right = mergeOwned(std::move(n->right), std::move(rest));
+        n->update();
+        return lhs;
+      }
+      NodeType *n = NodeType::makeUnique(rhs);
+      T const &key = n->data;
+      NodePtrType notGreater, greater;
+      splitOwned(std::move(lhs), [&lt, &key](T const &data) { return !lt(key, data); },
+                 notGreater, greater);
+      n->left = mergeOwned(std::move(notGreater), std::move(n->left));
+      n->right = mergeOwned(std::move(greater), std::move(n->right));
+      n->update();
+      return rhs;
+    }
+
+    /**
+     * Build a tree out of the sorted elements [first, last) with
+     * heap keys picked by Priority.
+     *
+     * Cost: O(n)
+     */
+    template <typename Iter>
+    static NodePtrType buildFromSorted(Iter first, Iter last) {
+      // 'spine' holds the right spine of the tree built so far. Every
+      // node popped off of it is complete.
+      std::vector<NodePtrType> spine;
+      for (; first != last; ++first) {
+        NodePtrType node = NodeType::create(*first, 0, 1);
+        const int heapKey = node->heapKey = Priority()(node->data);
+        NodePtrType popped;
+        while (!spine.empty() && spine.back()->heapKey > heapKey) {
+          spine.back()->right = std::move(popped);
+          spine.back()->update();
+          popped = std::move(spine.back());
+          spine.pop_back();
+        }
+        node->left = std::move(popped);
+        spine.push_back(std::move(node));
+      }
+      NodePtrType popped;
+      while (!spine.empty()) {
+        spine.back()->right = std::move(popped);
+        spine.back()->update();
+        popped = std::move(spine.back());
+        spine.pop_back();
+      }
+      return popped;
+    }
+
+    /**
+     * Erase one element from the tree rooted at 'node' for every
+     * element in the sorted range [first, last), and store the new
+     * root in 'out'. Where several elements compare equal, the first
+     * ones (in sorted order) are erased. Returns the number of
+     * elements at the end of [first, last) that compare equal to
+     * *(last - 1) and for which there was nothing left to erase.
+     *
+     * Every node visited is copied at most once, and untouched
+     * subtrees are shared with 'node'.
+     */
+    template <typename Iter>
+    static size_t eraseSorted(NodePtrType const &node, Iter first, Iter last,
+                              NodePtrType &out) {
+      KeyCompare lt;
+      if (first == last) {
+        out = node;
+        return 0;
+      }
+      if (!node) {
+        out = nullptr;
+        Iter it = last - 1;
+        while (it != first && !lt(*(it - 1), *it)) --it;
+        return last - it;
+      }
+      T const &key = node->data;
+      Iter lo = std::lower_bound(first, last, key, lt);
+      Iter hi = std::upper_bound(lo, last, key, lt);
+
+      // Elements == key are erased from the left subtree first, then
+      // this node, and then the right subtree.
+      NodePtrType left, right;
+      const size_t leftRemaining = eraseSorted(node->left, first, hi, left);
+      size_t equalRemaining = lo == hi ? 0 : leftRemaining;
+      const bool eraseNode = equalRemaining > 0;
+      if (eraseNode) {
+        --equalRemaining;
+      }
+      Iter rightFirst = hi - equalRemaining;
+      size_t rightRemaining = eraseSorted(node->right, rightFirst, last, right);
+
+      if (eraseNode) {
+        out = joinOwned(std::move(left), std::move(right));
+      } else if (left == node->left && right == node->right) {
+        out = node;
+      } else {
+        NodePtrType n = node->clone();
+        n->left = std::move(left);
+        n->right = std::move(right);
+        n->update();
+        out = std::move(n);
+      }
+
+      if (rightFirst != last) return rightRemaining;
+      if (lo != hi) return 0;
+      // [first, last) was handled entirely by the left subtree.
+      return leftRemaining;
+    }
+
+    /**
+     * Apply the set operation 'op' to the trees rooted at 'lhs' and
+     * 'rhs' and return the root of the result. Elements that compare
+     * equal are treated the same way as std::set_union(),
+     * std::set_intersection() and std::set_difference() treat them
+     * on sorted ranges.
+     *
+     * The root with the higher priority (of the 2 trees) is used to
+     * split the other tree, and the left and right halves are then
+     * computed independently (in parallel for large inputs). Subtrees
+     * that are unaffected by the operation are shared with the
+     * inputs.
+     *
+     * Cost: O(m log(n/m + 1)) where m <= n are the sizes of the
+     * inputs.
+     */
+    static NodePtrType setOperation(NodePtrType const &lhs, NodePtrType const &rhs,
+                                    SetOperation op, TreapTaskPool &pool) {
+      if (!lhs) return op == SetOperation::UNION ? rhs : nullptr;
+      if (!rhs) return op == SetOperation::INTERSECTION ? nullptr : lhs;
+
+      KeyCompare lt;
+      const bool pivotFromLhs = lhs->heapKey <= rhs->heapKey;
+      NodePtrType const &pivot = pivotFromLhs ? lhs : rhs;
+      NodePtrType const &other = pivotFromLhs ? rhs : lhs;
+      T const &key = pivot->data;
+      auto lessThanKey = [&lt, &key](T const &data) { return lt(data, key); };
+      auto notGreaterThanKey = [&lt, &key](T const &data) { return !lt(key, data); };
+
+      // Partition both trees into elements <, == and > key.
+      NodePtrType pivotLess, pivotEqualLeft, pivotEqualRight, pivotGreater;
+      splitNode(pivot->left, lessThanKey, pivotLess, pivotEqualLeft);
+      splitNode(pivot->right, notGreaterThanKey, pivotEqualRight, pivotGreater);
+      NodePtrType otherLess, otherRest, otherEqual, otherGreater;
+      splitNode(other, lessThanKey, otherLess, otherRest);
+      splitNode(otherRest, notGreaterThanKey, otherEqual, otherGreater);
+
+      NodePtrType less, greater;
+      auto computeLess = [&]() {
+        less = pivotFromLhs ? setOperation(pivotLess, otherLess, op, pool)
+                            : setOperation(otherLess, pivotLess, op, pool);
+      };
+      auto computeGreater = [&]() {
+        greater = pivotFromLhs ? setOperation(pivotGreater, otherGreater, op, pool)
+                               : setOperation(otherGreater, pivotGreater, op, pool);
+      };
+      if (lhs->subtreeSize + rhs->subtreeSize >= _treap_parallel_grain) {
+        pool.invoke(computeLess, computeGreater);
+      } else {
+        computeLess();
+        computeGreater();
+      }
+
+      if (!pivotEqualLeft && !pivotEqualRight && !otherEqual) {
+        // Common case: 'key' occurs exactly once.
+        const bool keepPivot = op == SetOperation::UNION ||
+          (op == SetOperation::DIFFERENCE && pivotFromLhs);
+        if (!keepPivot) {
+          return joinNodes(less, greater);
+        }
+        if (less == pivot->left && greater == pivot->right) {
+          return pivot;
+        }
+        NodePtrType n = pivot->clone();
+        n->left = std::move(less);
+        n->right = std::move(greater);
+        n->update();
+        return n;
+      }
+
+      // Compute the run of elements == key in the result.
+      NodePtrType pivotEqual =
+        joinNodes(joinNodes(pivotEqualLeft, NodeType::create(pivot->data, pivot->heapKey, 1)),
+                  pivotEqualRight);
+      NodePtrType const &lhsEqual = pivotFromLhs ? pivotEqual : otherEqual;
+      NodePtrType const &rhsEqual = pivotFromLhs ? otherEqual : pivotEqual;
+      const size_t lhsCount = lhsEqual ? lhsEqual->subtreeSize : 0;
+      const size_t rhsCount = rhsEqual ? rhsEqual->subtreeSize : 0;
+      NodePtrType equal, discard;
+      switch (op) {
+      case SetOperation::UNION:
+        splitNodeAt(rhsEqual, lhsCount, discard, equal);
+        equal = joinNodes(lhsEqual, equal);
+        break;
+      case SetOperation::INTERSECTION:
+        splitNodeAt(lhsEqual, std::min(lhsCount, rhsCount), equal, discard);
+        break;
+      case SetOperation::DIFFERENCE:
+        splitNodeAt(lhsEqual, rhsCount, discard, equal);
+        break;
+      }
+      return joinNodes(joinNodes(less, equal), greater);
+    }
+
+    NodePtrType deleteKey(T const &key) const {
+      NodePtrType newRoot;
+      if (!eraseNode(this->root, key, newRoot)) {
+        return this->root;
+      }
+      return newRoot;
+    }
+
+    /**
+     * Calls f(data, node) for every node below the slot 'n', in level
+     * order. The slots visited so far double as the queue.
+     */
+    template <typename Func>
+    void levelorder(NodePtrType &n, Func f) const {
+      if (!n) return;
+      std::vector<NodePtrType*> queue(1, &n);
+      for (size_t i = 0; i < queue.size(); ++i) {
+        NodePtrType &top = *queue[i];
+        if (top->left) queue.push_back(&top->left);
+        if (top->right) queue.push_back(&top->right);
+        f(top->data, top);
+      }
+    }
+
+    /**
+     * Calls f(data, node) for every node below the slot 'n', in
+     * sorted order, without recursing.
+     */
+    template <typename Func>
+    void inorder(NodePtrType &n, Func f) const {
+      std::vector<NodePtrType*> stack;
+      NodePtrType *slot = &n;
+      while (*slot || !stack.empty()) {
+        for (; *slot; slot = &(*slot)->left) {
+          stack.push_back(slot);
+        }
+        slot = stack.back();
+        stack.pop_back();
+        f((*slot)->data, *slot);
+        slot = &(*slot)->right;
+      }
+    }
+
+    /**
+     * Calls f(data) for every element of the subtree rooted at 'n',
+     * in sorted order, without recursing.
+     */
+    template <typename Func>
+    static void inorderElements(NodeType const *n, Func &f) {
+      TreapNodeStack<NodeType const> stack;
+      while (n || !stack.empty()) {
+        for (; n; n = n->left.get()) {
+          stack.push_back(n);
+        }
+        n = stack.back();
+        stack.pop_back();
+        f(n->data);
+        n = n->right.get();
+      }
+    }
+
+    static bool runsInParallel(NodeType const *n, TreapTaskPool &pool) {
+      return n->subtreeSize >= _treap_parallel_grain && pool.concurrency() > 1;
+    }
+
+    /**
+     * Calls f(data) for every element of the subtree rooted at 'n',
+     * handing large subtrees to 'pool'.
+     */
+    template <typename Func>
+    static void forEachNode(NodeType const *n, Func &f, TreapTaskPool &pool) {
+      if (!n) return;
+      if (!runsInParallel(n, pool)) {
+        inorderElements(n, f);
+        return;
+      }
+      pool.invoke([&]() { forEachNode(n->left.get(), f, pool); },
+                  [&]() { forEachNode(n->right.get(), f, pool); });
+      f(n->data);
+    }
+
+    /**
+     * Combines transform(data) for every element of the (non empty)
+     * subtree rooted at 'n' using 'op', in sorted order. Both child
+     * subtrees of a large subtree are reduced in parallel.
+     */
+    template <typename R, typename Op, typename Transform>
+    static R transformReduceNode(NodeType const *n, Op const &op,
+                                 Transform const &transform, TreapTaskPool &pool) {
+      if (!runsInParallel(n, pool)) {
+        std::unique_ptr<R> result;
+        auto combine = [&result, &op, &transform](T const &data) {
+          if (result) {
+            *result = op(std::move(*result), transform(data));
+          } else {
+            result.reset(new R(transform(data)));
+          }
+        };
+        inorderElements(n, combine);
+        return std::move(*result);
+      }
+      std::unique_ptr<R> left, right;
+      pool.invoke([&]() {
+          if (n->left) {
+            left.reset(new R(transformReduceNode<R>(n->left.get(), op, transform, pool)));
+          }
+        }, [&]() {
+          if (n->right) {
+            right.reset(new R(transformReduceNode<R>(n->right.get(), op, transform, pool)));
+          }
+        });
+      R result = transform(n->data);
+      if (left) result = op(std::move(*left), std::move(result));
+      if (right) result = op(std::move(result), std::move(*right));
+      return result;
+    }
+
+    /**
+     * The node in 'node' if 'keep' and its children are unchanged,
+     * or else a new subtree with 'left' and 'right' (and node->data,
+     * if 'keep').
+     */
+    static NodePtrType rebuildFiltered(NodePtrType const &node, bool keep,
+                                       NodePtrType left, NodePtrType right) {
+      if (!keep) {
+        return joinNodes(left, right);
+      }
+      if (left == node->left && right == node->right) {
+        return node;
+      }
+      NodePtrType copy = NodeType::create(node->data, node->heapKey, 1,
+                                          std::move(left), std::move(right));
+      copy->update();
+      return copy;
+    }
+
+    /**
+     * The subtree rooted at 'node' without the elements for which
+     * pred(data) is false. Subtrees in which every element is kept
+     * are shared.
+     *
+     * Cost: O(n)
+     */
+    template <typename Pred>
+    static NodePtrType filterNode(NodePtrType const &node, Pred const &pred,
+                                  TreapTaskPool &pool) {
+      if (!node) return nullptr;
+      if (runsInParallel(node.get(), pool)) {
+        NodePtrType left, right;
+        bool keep = false;
+        pool.invoke([&]() {
+            left = filterNode(node->left, pred, pool);
+            keep = pred(node->data);
+          }, [&]() { right = filterNode(node->right, pred, pool); });
+        return rebuildFiltered(node, keep, std::move(left), std::move(right));
+      }
+      // Post-order traversal. 'built' holds the filtered versions of
+      // the completed subtrees.
+      std::vector<std::pair<NodePtrType const*, bool> > stack;
+      std::vector<NodePtrType> built;
+      stack.push_back(std::make_pair(&node, false));
+      while (!stack.empty()) {
+        NodePtrType const &n = *stack.back().first;
+        if (!stack.back().second) {
+          stack.back().second = true;
+          if (n->right) stack.push_back(std::make_pair(&n->right, false));
+          if (n->left) stack.push_back(std::make_pair(&n->left, false));
+          continue;
+        }
+        stack.pop_back();
+        NodePtrType right, left;
+        if (n->right) {
+          right = std::move(built.back());
+          built.pop_back();
+        }
+        if (n->left) {
+          left = std::move(built.back());
+          built.pop_back();
+        }
+        built.push_back(rebuildFiltered(n, pred(n->data), std::move(left), std::move(right)));
+      }
+      return std::move(built.back());
+    }
+
+    Treap(NodePtrType _root) :
+      root(_root) { }
+
+    friend class TransientTreap<T, LessThan, Alloc, Summary, Layout, Priority>;
+    template <typename, typename, typename, typename>
+    friend class PersistentMap;
+    friend class AtomicTreap<T, LessThan, Alloc, Summary, Layout, Priority>;
+    friend class TreapSnapshot<T, LessThan, Alloc, Summary, Layout, Priority>;
+    friend class TreapDeltaWriter<T, LessThan, Alloc, Summary, Layout, Priority>;
+    friend class TreapDeltaReplayer<T, LessThan, Alloc, Summary, Layout, Priority>;
+
+    template <typename Iter>
+    void fillNodes(Iter first, Iter last,
+                   std::vector<NodePtrType> &nodes) const {
+      for (; first != last; ++first) {
+        nodes.push_back(NodeType::create(*first, 0, 1));
+      }
+    }
+
+    /**
+     * Precondition: last - first > 0
+     */
+    template <typename Iter>
+    void assignSorted(Iter first, Iter last) {
+      if (Priority::keyed) {
+        // The heap keys, and so the shape, are fixed by the elements.
+        this->root = buildFromSorted(first, last);
+        return;
+      }
+      std::vector<NodePtrType> allNodes;
+      this->fillNodes(first, last, allNodes);
+
+      std::vector<NodePtrType> nodes[2];
+
+#define NODE_GET(IDX) ((IDX) < nodes[1].size() ? nodes[1][IDX] : nullptr)
+      size_t start = 1;
+      size_t hjump = 2;
+      while (start <= allNodes.size()) {
+        nodes[0].swap(nodes[1]);
+        nodes[0].clear();
+        size_t ctr = 0;
+#if 0
+        fprintf(stderr, "New Set [start: %d] [hjump: %d]\n", start, hjump);
+#endif
+
+        for (size_t i = start - 1; i < allNodes.size(); i += hjump) {
+          auto &nn = allNodes[i];
+          nn->left = NODE_GET(ctr); ctr++;
+          nn->right = NODE_GET(ctr); ctr++;
+          nn->update();
+          // cerr << nn->subtreeSize << ", ";
+          nodes[0].push_back(nn);
+        }
+        // Copy residual nodes from nodes[1] to nodes[0].
+        while (ctr < nodes[1].size()) {
+          nodes[0].push_back(nodes[1][ctr++]);
+        }
+        start *= 2;
+        hjump *= 2;
+        // cerr << std::endl;
+      }
+#undef NODE_GET
+      assert(nodes[0].size() == 1);
+      this->root = nodes[0][0];
+      // Draw a heap key for every node, then sift the keys down (as
+      // when building a binary heap) until every node's key is <=
+      // those of its children. The tree is balanced, so visiting the
+      // nodes in reverse level order makes this O(n).
+      std::vector<NodeType*> levels;
+      levels.reserve(this->size());
+      this->levelorder(this->root, [&levels] (T const&, NodePtrType &node) {
+          node->heapKey = Priority()(node->data);
+          levels.push_back(node.get());
+        });
+      for (auto it = levels.rbegin(); it != levels.rend(); ++it) {
+        NodeType *n = *it;
+        while (true) {
+          NodeType *smallest = n;
+          if (n->left && n->left->heapKey < smallest->heapKey) smallest = n->left.get();
+          if (n->right && n->right->heapKey < smallest->heapKey) smallest = n->right.get();
+          if (smallest == n) break;
+          std::swap(n->heapKey, smallest->heapKey);
+          n = smallest;
+        }
+      }
+    }
+
+  public:
+    Treap() { }
+    Treap(Treap const &rhs) {
+      this->root = rhs.root;
+    }
+    /* No MOVE semantics since this is an immutable data structure. */
+    Treap& operator=(Treap const &rhs) {
+      this->root = rhs.root;
+      return *this;
+    }
+    /**
+     * Bulk load from a possibly sorted set. Unsorted input is first
+     * (stable) sorted in parallel using 'pool', so elements that
+     * compare equal retain their relative order, as they would if
+     * they had been inserted one by one.
+     *
+     * Cost: O(n) for sorted input, and O(n log n / p) otherwise.
+     */
+    template <typename Iter>
+    Treap(Iter first, Iter last,
+          TreapTaskPool &pool = TreapTaskPool::instance()) {
+      TREAP_STATS_SCOPE(BUILD);
+      typedef typename std::iterator_traits<Iter>::value_type IterValueType;
+      // Do we have at least 2 elements?
+      if (first == last) return;
+      auto f = first;
+      ++f;
+      if (f == last) {
+        // Single element
+        this->root = NodeType::create(*first, 0, 1);
+        this->root->heapKey = Priority()(this->root->data);
+        return;
+      }
+
+      // Invariant: last - first > 1.
+      //
+      // Check if input range is sorted.
+      if (std::adjacent_find(first, last,
+                             [] (IterValueType const &lhs,
+                                 IterValueType const &rhs) {
+                               return KeyCompare()(rhs, lhs);
+                             }) != last) {
+        // Unsorted: O(n log n)
+        std::vector<T> elements(first, last);
+        parallelStableSort(elements.begin(), elements.end(), KeyCompare(), pool);
+        this->assignSorted(elements.begin(), elements.end());
+      } else {
+        // Sorted: O(n)
+        this->assignSorted(first, last);
+      }
+    }
+
+    size_t size() const {
+      return this->root ? this->root->subtreeSize : 0;
+    }
+
+    bool empty() const {
+      return this->root ? false : true;
+    }
+
+    /**
+     * Write a snapshot of this treap to 'out' (see
+     * TreapSnapshotHeader for the format). Elements are copied
+     * byte-wise, so T must be trivially copyable and must not contain
+     * pointers. Load it back with load() or TreapSnapshot.
+     *
+     * Cost: O(n)
+     */
+    std::ostream& save(std::ostream &out) const {
+      this->writeSnapshot([&out](void const *data, size_t size) {
+          out.write(static_cast<char const*>(data), size);
+          return out.good();
+        });
+      return out;
+    }
+
+    /**
+     * Same as save(ostream), to the file descriptor 'fd'. Returns
+     * false (with errno set) if writing fails.
+     */
+    bool save(int fd) const {
+      return this->writeSnapshot([fd](void const *data, size_t size) {
+          char const *bytes = static_cast<char const*>(data);
+          while (size > 0) {
+            const ssize_t written = ::write(fd, bytes, size);
+            if (written < 0) {
+              if (errno == EINTR) continue;
+              return false;
+            }
+            bytes += written;
+            size -= written;
+          }
+          return true;
+        });
+    }
+
+    /**
+     * Read a snapshot written by save(). The tree is rebuilt with the
+     * saved shape and heap keys, without comparing any elements. On
+     * error, sets the failbit of 'in' and returns an empty treap.
+     *
+     * Cost: O(n)
+     */
+    static Treap load(std::istream &in) {
+      TreapSnapshotHeader header;
+      Treap result;
+      if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+          !header.valid(sizeof(SnapshotRecord))) {
+        in.setstate(std::ios::failbit);
+        return result;
+      }
+      std::vector<SnapshotRecord> records(header.count);
+      if (!in.read(reinterpret_cast<char*>(records.data()),
+                   header.count * sizeof(SnapshotRecord)) ||
+          !buildFromRecords(records.data(), header, result.root)) {
+        in.setstate(std::ios::failbit);
+      }
+      return result;
+    }
+
+    /**
+     * Summary of all the elements.
+     *
+     * Cost: O(1)
+     */
+    summary_type aggregate() const {
+      return this->root ? this->root->summary() : Summary::identity();
+    }
+
+    /**
+     * Summary of the elements in [first, last), combined in sorted
+     * order. Both iterators must belong to this treap.
+     *
+     * Cost: O(log n)
+     */
+    summary_type aggregate(iterator const &first, iterator const &last) const {
+      assert(first.root == this->root.get() && last.root == this->root.get());
+      return summarizeRange(this->root.get(), first.rank(), last.rank());
+    }
+
+    /**
+     * Nodes and bytes reachable from this version, including those
+     * shared with other versions.
+     *
+     * Cost: O(1)
+     */
+    TreapMemoryUsage memory_usage() const {
+      return memoryUsage(this->size());
+    }
+
+    /**
+     * Nodes and bytes that would be freed if this version were
+     * dropped, i.e. the nodes referenced (transitively) only by this
+     * treap object. Returns 0 if another Treap object shares this
+     * version's root. The result is a snapshot: other
+     * threads creating or dropping versions can change it.
+     *
+     * Cost: O(k) where k is the number of reclaimable nodes.
+     */
+    TreapMemoryUsage reclaimable_memory() const {
+      size_t nodes = 0;
+      walkNodes(this->root.get(), [&nodes](NodeType const *n) {
+          if (n->refs.get() != 1) return false;
+          ++nodes;
+          return true;
+        });
+      return memoryUsage(nodes);
+    }
+
+    /**
+     * Reports, for every version in [first, last), how many of its
+     * nodes are shared with some other version in [first, last) and
+     * how many are exclusive to it. The exclusive nodes of a version
+     * are the ones that dropping it would free if the versions in
+     * [first, last) were the only ones alive.
+     *
+     * Every node is visited once, no matter how many versions share
+     * it, and subtrees already visited through another version are
+     * skipped.
+     *
+     * Cost: O(u + v) where u is the number of distinct nodes in all
+     * the versions and v is the number of versions.
+     */
+    template <typename Iter>
+    static std::vector<TreapVersionMemory> memory_report(Iter first, Iter last) {
+      const size_t SHARED = static_cast<size_t>(-1);
+      std::vector<NodeType const*> roots;
+      for (; first != last; ++first) {
+        roots.push_back(first->root.get());
+      }
+      // Maps every node to the first version that reached it, or to
+      // SHARED for the topmost nodes reached by more than one
+      // version. Nodes under a SHARED node are shared as well.
+      std::unordered_map<NodeType const*, size_t> owner;
+      for (size_t i = 0; i < roots.size(); ++i) {
+        walkNodes(roots[i], [&owner, i, SHARED](NodeType const *n) {
+            auto inserted = owner.insert(std::make_pair(n, i));
+            if (!inserted.second) {
+              inserted.first->second = SHARED;
+              return false;
+            }
+            return true;
+          });
+      }
+
+      std::vector<TreapVersionMemory> report(roots.size());
+      for (size_t i = 0; i < roots.size(); ++i) {
+        const size_t total = roots[i] ? roots[i]->subtreeSize : 0;
+        size_t exclusive = 0;
+        walkNodes(roots[i], [&owner, &exclusive, SHARED](NodeType const *n) {
+            if (owner.find(n)->second == SHARED) return false;
+            ++exclusive;
+            return true;
+          });
+        report[i].total = memoryUsage(total);
+        report[i].shared = memoryUsage(total - exclusive);
+        report[i].exclusive = memoryUsage(exclusive);
+      }
+      return report;
+    }
+
+    /**
+     * memory_report() for this version and 'other'; returns the
+     * entry for this version.
+     */
+    TreapVersionMemory memory_usage(Treap const &other) const {
+      Treap const versions[] = { *this, other };
+      return memory_report(versions, versions + 2)[0];
+    }
+
+    /**
+     * Height and average node depth of this version, to check how
+     * well Priority balances it.
+     *
+     * Cost: O(n)
+     */
+    TreapDepthStats depth_stats() const {
+      TreapDepthStats stats = { this->size(), 0, 0.0, 0.0 };
+      if (!this->root) return stats;
+      double totalDepth = 0;
+      std::vector<std::pair<NodeType const*, size_t> > pending;
+      pending.push_back(std::make_pair(this->root.get(), size_t(0)));
+      while (!pending.empty()) {
+        NodeType const *n = pending.back().first;
+        const size_t depth = pending.back().second;
+        pending.pop_back();
+        totalDepth += depth;
+        stats.height = std::max(stats.height, depth);
+        if (n->left) pending.push_back(std::make_pair(n->left.get(), depth + 1));
+        if (n->right) pending.push_back(std::make_pair(n->right.get(), depth + 1));
+      }
+      double harmonic = 0;
+      for (size_t i = 1; i <= stats.nodes; ++i) {
+        harmonic += 1.0 / i;
+      }
+      stats.averageDepth = totalDepth / stats.nodes;
+      stats.expectedAverageDepth = 2 * (1 + 1.0 / stats.nodes) * harmonic - 4;
+      return stats;
+    }
+
+    /**
+     * Returns a batch-mutable copy of this treap. See TransientTreap.
+     *
+     * Cost: O(1)
+     */
+    TransientTreap<T, LessThan, Alloc, Summary, Layout, Priority> transient() const {
+      return TransientTreap<T, LessThan, Alloc, Summary, Layout, Priority>(*this);
+    }
+
+    Treap insert(T const &data) const {
+      TREAP_STATS_SCOPE(INSERT);
+      Treap newTreap(*this);
+      NodePtrType node = NodeType::create(data, Priority()(data), 1);
+      newTreap.root = insertNode(this->root, node);
+      return newTreap;
+    }
+
+    /**
+     * Insert 'data' as close as possible to just before 'hint', an
+     * iterator into this treap, and return the new treap. As with
+     * std::multiset::insert(hint, value), 'data' goes immediately
+     * before 'hint' if it is equivalent to *hint, before the first
+     * equivalent element if it is greater than *hint, and after the
+     * last equivalent element if it is smaller. If 'hint' is end()
+     * and 'data' is not smaller than the last element, it is appended
+     * along the right spine without comparing any more keys.
+     * Otherwise the search starts at the hint: it climbs the hint's
+     * path only as far as the nearest ancestor whose subtree can hold
+     * 'data', and descends from there. For a hint at distance d from
+     * the insertion point, that takes an expected O(log d)
+     * comparisons instead of O(log n).
+     *
+     * This only saves comparisons. The nodes above the insertion
+     * point are still copied, as for every insert, and usually cost
+     * more than the comparisons saved.
+     *
+     * Cost: O(log n)
+     */
+    Treap insert(iterator const &hint, T const &data) const {
+      TREAP_STATS_SCOPE(INSERT);
+      assert(hint.root == this->root.get());
+      NodePtrType node = NodeType::create(data, Priority()(data), 1);
+      if (!this->root) {
+        return Treap(node);
+      }
+      KeyCompare lt;
+      typename iterator::PtrsType path(hint.getRootToNodePtrs());
+      if (path.empty()) {
+        NodeType const *last = this->root.get();
+        while (last->right) last = last->right.get();
+        if (!lt(node->data, last->data)) {
+          return Treap(insertNodeAt(this->root, node, this->size()));
+        }
+        // end(): start from the largest element.
+        for (NodeType const *n = this->root.get(); n; n = n->right.get()) {
+          path.push_back(n);
+        }
+      } else if (!lt(node->data, path.back()->data) && !lt(path.back()->data, node->data)) {
+        return Treap(insertNodeAt(this->root, node, hint.rank()));
+      }
+
+      // Every ancestor that path[i] is a left descendant of bounds
+      // its subtree from above, and every ancestor it is a right
+      // descendant of bounds it from below. If 'data' is greater
+      // than the hint, only the upper bounds can exclude it (and only
+      // the lower ones if it is smaller), and the nearest one is the
+      // tightest. Climb past those that exclude it.
+      size_t start = path.size() - 1;
+      const bool after = !lt(node->data, path.back()->data);
+      for (size_t i = path.size() - 1; i > 0; --i) {
+        NodeType const *parent = path[i - 1];
+        if (after ? path[i]->isLeftChildOf(parent) : path[i]->isRightChildOf(parent)) {
+          TREAP_STATS_ADD(pathNodes, 1);
+          if (after ? !lt(parent->data, node->data) : !lt(node->data, parent->data)) {
+            break;
+          }
+          start = i - 1;
+        }
+      }
+
+      // path[0 .. start] is a prefix of the search path for 'data',
+      // so only the priorities along it need checking before
+      // continuing the descent from path[start].
+      size_t depth = 0;
+      while (depth < start && !(node->heapKey < path[depth]->heapKey)) {
+        ++depth;
+      }
+      NodePtrType const &subtree = depth == 0 ? this->root
+        : path[depth]->isLeftChildOf(path[depth - 1]) ? path[depth - 1]->left
+        : path[depth - 1]->right;
+      if (!after) {
+        // After the elements equivalent to 'data' (the upper bound),
+        // which is the position closest to the hint.
+        return Treap(replaceAtPath(path, depth, insertNode(subtree, node)));
+      }
+      // Before the elements equivalent to 'data' (the lower bound).
+      T const &value = node->data;
+      NodePtrType inserted =
+        insertNode(subtree, node, [&lt, &value](T const &elem) { return lt(elem, value); });
+      return Treap(replaceAtPath(path, depth, std::move(inserted)));
+    }
+
+    /**
+     * Erases the first element (in sorted order) with KEY == key.
+     * Returns a new treap with the element removed, or this treap if
+     * there is no such element. The first element isn't necessarily
+     * the first one inserted with KEY == key.
+     *
+     * Cost: O(log n)
+     */
+    Treap erase(T const &key) const {
+      TREAP_STATS_SCOPE(ERASE);
+      Treap newTreap(*this);
+      newTreap.root = newTreap.deleteKey(key);
+      return newTreap;
+    }
+
+    /**
+     * Erases the element pointed to by iterator 'it'. Returns a new
+     * treap with the element removed.
+     */
+    Treap erase(iterator const &it) const {
+      TREAP_STATS_SCOPE(ERASE);
+      assert(it != this->end());
+      assert(it.root == this->root.get());
+      assert(this->root.get() != nullptr);
+      Treap newTreap(*this);
+      newTreap.root = newTreap.deleteIterator(it);
+      return newTreap;
+    }
+
+    /**
+     * Erases the elements in [first, last). Returns a new treap with
+     * the elements removed. Only the nodes along the 2 boundaries of
+     * the range are copied; everything outside it is shared.
+     *
+     * Cost: O(log n)
+     */
+    Treap erase(iterator const &first, iterator const &last) const {
+      TREAP_STATS_SCOPE(ERASE);
+      assert(first.root == this->root.get() && last.root == this->root.get());
+      const size_t firstRank = first.rank();
+      const size_t lastRank = last.rank();
+      assert(firstRank <= lastRank);
+      if (firstRank == lastRank) {
+        return *this;
+      }
+      NodePtrType lhs, rest, middle, rhs;
+      splitNodeAt(this->root, firstRank, lhs, rest);
+      splitNodeAt(rest, lastRank - firstRank, middle, rhs);
+      return Treap(joinNodes(lhs, rhs));
+    }
+
+    /**
+     * Erases every element e with lo <= e < hi, and returns the new
+     * treap.
+     *
+     * Cost: O(log n)
+     */
+    Treap erase_range(T const &lo, T const &hi) const {
+      return this->extract_range(lo, hi).first;
+    }
+
+    /**
+     * Removes every element e with lo <= e < hi. Returns the new
+     * treap, and a treap of the removed elements, which shares every
+     * node inside the range with this treap.
+     *
+     * Cost: O(log n)
+     */
+    std::pair<Treap, Treap> extract_range(T const &lo, T const &hi) const {
+      TREAP_STATS_SCOPE(ERASE);
+      if (!KeyCompare()(lo, hi)) {
+        return std::make_pair(*this, Treap());
+      }
+      NodePtrType lhs, middle, rhs;
+      splitRange(this->root, lo, hi, lhs, middle, rhs);
+      if (!middle) {
+        return std::make_pair(*this, Treap());
+      }
+      return std::make_pair(Treap(joinNodes(lhs, rhs)), Treap(middle));
+    }
+
+    /**
+     * Update the Treap and replace oldKey with newKey. It is assumed
+     * that newKey fits in *exactly* the same place as oldKey. If not,
+     * this will violate the BST properties.
+     */
+    Treap update(T const &oldKey, T const &newKey) const {
+      TREAP_STATS_SCOPE(UPDATE);
+      assert(!KeyCompare()(oldKey, newKey) && !KeyCompare()(newKey, oldKey));
+      auto it = this->find(oldKey);
+      if (it == this->end()) {
+        return *this;
+      }
+      auto ptrs = this->clonePtrs(it.getRootToNodePtrs());
+      ptrs.back()->data = newKey;
+      // newKey may have a different summary.
+      for (size_t i = ptrs.size(); i > 0; --i) {
+        ptrs[i - 1]->update();
+      }
+      Treap newTreap(ptrs[0]);
+      return newTreap;
+    }
+
+    /**
+     * Split this treap into 2 treaps; the first containing all
+     * elements < key, and the second containing all elements >=
+     * key. Nodes not on the split path are shared with this treap.
+     *
+     * Cost: O(log n)
+     */
+    std::pair<Treap, Treap> split(T const &key) const {
+      TREAP_STATS_SCOPE(SPLIT_JOIN);
+      KeyCompare lt;
+      std::pair<Treap, Treap> parts;
+      splitNode(this->root, [&lt, &key](T const &data) { return lt(data, key); },
+                parts.first.root, parts.second.root);
+      return parts;
+    }
+
+    /**
+     * Split this treap into 2 treaps; the first containing the
+     * smallest 'rank' elements, and the second containing the rest.
+     *
+     * Cost: O(log n)
+     */
+    std::pair<Treap, Treap> split_at(size_t rank) const {
+      TREAP_STATS_SCOPE(SPLIT_JOIN);
+      assert(rank <= this->size());
+      std::pair<Treap, Treap> parts;
+      splitNodeAt(this->root, rank, parts.first.root, parts.second.root);
+      return parts;
+    }
+
+    /**
+     * Returns a treap containing all the elements of 'lhs' followed
+     * by all the elements of 'rhs'. Every element in 'lhs' must be <=
+     * every element in 'rhs'.
+     *
+     * Cost: O(log n)
+     */
+    static Treap join(Treap const &lhs, Treap const &rhs) {
+      TREAP_STATS_SCOPE(SPLIT_JOIN);
+      assert(lhs.empty() || rhs.empty() ||
+             !KeyCompare()(*rhs.begin(), *(--lhs.end())));
+      Treap joined(joinNodes(lhs.root, rhs.root));
+      return joined;
+    }
+
+    /**
+     * Returns a treap with the elements in either this treap or
+     * 'other'. An element that occurs m times here and n times in
+     * 'other' occurs max(m, n) times in the result.
+     *
+     * Cost: O(m log(n/m + 1)) where m <= n are the sizes of the 2
+     * treaps. Large inputs are processed in parallel using 'pool'.
+     */
+    Treap set_union(Treap const &other,
+                    TreapTaskPool &pool = TreapTaskPool::instance()) const {
+      TREAP_STATS_SCOPE(SET_OPERATION);
+      Treap result(setOperation(this->root, other.root, SetOperation::UNION, pool));
+      return result;
+    }
+
+    /**
+     * Returns a treap with the elements in both this treap and
+     * 'other'. An element that occurs m times here and n times in
+     * 'other' occurs min(m, n) times in the result.
+     *
+     * Cost: Same as set_union().
+     */
+    Treap set_intersection(Treap const &other,
+                           TreapTaskPool &pool = TreapTaskPool::instance()) const {
+      TREAP_STATS_SCOPE(SET_OPERATION);
+      Treap result(setOperation(this->root, other.root, SetOperation::INTERSECTION, pool));
+      return result;
+    }
+
+    /**
+     * Returns a treap with the elements in this treap that are not in
+     * 'other'. An element that occurs m times here and n times in
+     * 'other' occurs max(m - n, 0) times in the result.
+     *
+     * Cost: Same as set_union().
+     */
+    Treap set_difference(Treap const &other,
+                         TreapTaskPool &pool = TreapTaskPool::instance()) const {
+      TREAP_STATS_SCOPE(SET_OPERATION);
+      Treap result(setOperation(this->root, other.root, SetOperation::DIFFERENCE, pool));
+      return result;
+    }
+
+    /**
+     * Insert every element in [first, last) and return the new
+     * treap. Equivalent to calling insert() for every element, but
+     * all elements are applied in a single recursive pass, so every
+     * existing node is copied at most once.
+     *
+     * Cost: O(k log(n/k + 1)) for k sorted elements. Unsorted input
+     * is sorted first.
+     */
+    template <typename Iter>
+    Treap insert_batch(Iter first, Iter last) const {
+      TREAP_STATS_SCOPE(BATCH);
+      std::vector<T> batch(first, last);
+      if (batch.empty()) {
+        return *this;
+      }
+      if (!std::is_sorted(batch.begin(), batch.end(), KeyCompare())) {
+        std::stable_sort(batch.begin(), batch.end(), KeyCompare());
+      }
+      Treap newTreap(*this);
+      NodePtrType added = buildFromSorted(batch.begin(), batch.end());
+      newTreap.root = mergeOwned(this->root, std::move(added));
+      return newTreap;
+    }
+
+    /**
+     * Erase one element with KEY == key for every key in [first,
+     * last) and return the new treap. Equivalent to calling
+     * erase(key) for every key, but all keys are applied in a single
+     * recursive pass, so every existing node is copied at most once.
+     *
+     * Cost: O(k log(n/k + 1)) for k sorted keys. Unsorted input is
+     * sorted first.
+     */
+    template <typename Iter>
+    Treap erase_batch(Iter first, Iter last) const {
+      TREAP_STATS_SCOPE(BATCH);
+      std::vector<T> batch(first, last);
+      if (!std::is_sorted(batch.begin(), batch.end(), KeyCompare())) {
+        std::sort(batch.begin(), batch.end(), KeyCompare());
+      }
+      Treap newTreap(*this);
+      eraseSorted(this->root, batch.begin(), batch.end(), newTreap.root);
+      return newTreap;
+    }
+
+    bool exists(T const &key) const {
+      TREAP_STATS_SCOPE(LOOKUP);
+      NodePtrType tmp = root;
+      KeyCompare lt;
+      while (tmp) {
+        TREAP_STATS_ADD(pathNodes, 1);
+        if (lt(key, tmp->data)) {
+          tmp = tmp->left;
+        } else if (lt(tmp->data, key)) {
+          tmp = tmp->right;
+        } else {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    /**
+     * The first position before which we can insert 'key' and remain
+     * sorted.
+     */
+    iterator lower_bound(T const &key) const {
+      TREAP_STATS_SCOPE(LOOKUP);
+      NodeType const *tmp = this->root.get();
+      KeyCompare lt;
+      typename iterator::PtrsType ptrs;
+      size_t capSize = 0;
+      while (tmp) {
+        TREAP_STATS_ADD(pathNodes, 1);
+        ptrs.push_back(tmp);
+        if (!lt(tmp->data, key)) { // key <= tmp->data
+          capSize = ptrs.size();
+          tmp = tmp->left.get();
+        } else { // key > tmp->data
+          tmp = tmp->right.get();
+        }
+      }
+      ptrs.resize(capSize);
+      return iterator(std::move(ptrs), this->root.get());
+    }
+
+    /**
+     * The last position before which we can insert 'key' and remain
+     * sorted.
+     */
+    iterator upper_bound(T const &key) const {
+      TREAP_STATS_SCOPE(LOOKUP);
+      NodeType const *tmp = this->root.get();
+      KeyCompare lt;
+      typename iterator::PtrsType ptrs;
+      size_t capSize = 0;
+      while (tmp) {
+        TREAP_STATS_ADD(pathNodes, 1);
+        ptrs.push_back(tmp);
+        if (lt(key, tmp->data)) { // key < tmp->data
+          capSize = ptrs.size();
+          tmp = tmp->left.get();
+        } else { // key >= tmp->data
+          tmp = tmp->right.get();
+        }
+      }
+      ptrs.resize(capSize);
+      return iterator(std::move(ptrs), this->root.get());
+    }
+
+    iterator find(T const &key) const {
+      iterator it = this->lower_bound(key);
+      KeyCompare lt;
+      if (it != this->end() && !lt(key, *it) && !lt(*it, key)) {
+        return it;
+      }
+      return this->end();
+    }
+
+    /**
+     * Count the number of elements with KEY == key.
+     *
+     * Complexity: O(log n)
+     *
+     */
+    size_t count(T const& key) const {
+      TREAP_STATS_SCOPE(LOOKUP);
+      KeyCompare lt;
+      return countBetween(this->root.get(),
+                          [&lt, &key](T const &data) { return lt(data, key); },
+                          [&lt, &key](T const &data) { return !lt(key, data); });
+    }
+
+    /**
+     * The number of elements < key, i.e. the rank of lower_bound(key),
+     * without building an iterator.
+     *
+     * Cost: O(log n)
+     */
+    size_t rank(T const &key) const {
+      TREAP_STATS_SCOPE(LOOKUP);
+      KeyCompare lt;
+      return countPrefix(this->root.get(), [&lt, &key](T const &data) { return lt(data, key); });
+    }
+
+    /**
+     * The element of rank 'k' (0 based), i.e. *(begin() + k), without
+     * building an iterator. Throws std::out_of_range unless
+     * k < size().
+     *
+     * Cost: O(log n)
+     */
+    T const& select(size_t k) const {
+      TREAP_STATS_SCOPE(LOOKUP);
+      if (k >= this->size()) {
+        throw std::out_of_range("Treap::select: rank out of range");
+      }
+      NodeType const *n = this->root.get();
+      while (true) {
+        TREAP_STATS_ADD(pathNodes, 1);
+        const size_t leftSize = n->left ? n->left->subtreeSize : 0;
+        if (k < leftSize) {
+          n = n->left.get();
+        } else if (k == leftSize) {
+          return n->data;
+        } else {
+          k -= leftSize + 1;
+          n = n->right.get();
+        }
+      }
+    }
+
+    /**
+     * The number of elements e with lo <= e < hi.
+     *
+     * Cost: O(log n)
+     */
+    size_t count_range(T const &lo, T const &hi) const {
+      TREAP_STATS_SCOPE(LOOKUP);
+      KeyCompare lt;
+      if (!lt(lo, hi)) return 0;
+      return countBetween(this->root.get(),
+                          [&lt, &lo](T const &data) { return lt(data, lo); },
+                          [&lt, &hi](T const &data) { return lt(data, hi); });
+    }
+
+    /**
+     * The 'p'th percentile (0 <= p <= 100) by the nearest rank
+     * method: the smallest element such that at least p% of the
+     * elements are <= it. Throws std::out_of_range if the treap is
+     * empty or 'p' is outside [0, 100].
+     *
+     * Cost: O(log n)
+     */
+    T const& percentile(double p) const {
+      if (this->empty()) {
+        throw std::out_of_range("Treap::percentile: empty treap");
+      }
+      if (!(p >= 0 && p <= 100)) {
+        throw std::out_of_range("Treap::percentile: p must be in [0, 100]");
+      }
+      const size_t n = this->size();
+      size_t rank = static_cast<size_t>(std::ceil(p / 100 * n));
+      rank = std::min(std::max<size_t>(rank, 1), n);
+      return this->select(rank - 1);
+    }
+
+    std::ostream& print(std::ostream &out) const {
+      this->for_each([&out](T const &data, NodePtrType node) {
+          out << data << ", ";
+        });
+      return out;
+    }
+
+    /**
+     * Print a graphviz consumable tree representation of this
+     * treap. Values in parenthesis represent heap keys and
+     * subtree-sizes.
+     *
+     * Node format: Key(heapKey,subtreeSize)
+     *
+     */
+    std::ostream& toDot(std::ostream &out) const {
+      out << "digraph Treap {\n";
+      this->for_each([&out](T const &data, NodePtrType node) {
+          std::ostringstream buff1, buff2, buff3;
+          buff1 << node->data << "(" << node->heapKey << "," << node->subtreeSize << ")";
+          if (node->left) {
+            buff2 << node->left->data << "(" << node->left->heapKey << "," << node->left->subtreeSize << ")";
+          } else {
+            buff2 << node.get() << "L";
+            out << "  \"" << buff2.str() << "\"[shape=point]\n";
+          }
+          out << "  \"" << buff1.str() << "\" -> \"" << buff2.str() << "\"[label=L]\n";
+          if (node->right) {
+            buff3 << node->right->data << "(" << node->right->heapKey << "," << node->right->subtreeSize << ")";
+          } else {
+            buff3 << node.get() << "R";
+            out << "  \"" << buff3.str() << "\"[shape=point]\n";
+          }
+          out << "  \"" << buff1.str() << "\" -> \"" << buff3.str() << "\"[label=R]\n";
+        });
+      out << "}\n";
+      return out;
+    }
+
+    /**
+     * Apply function 'f' to every element in the treap (in sorted
+     * order).
+     */
+    template <typename Func>
+    void for_each(Func f) const {
+      this->inorder(this->root, f);
+    }
+
+    /**
+     * Call f(element) for every element, splitting the work between
+     * the threads of 'pool' by subtree size. Calls may run
+     * concurrently and in any order.
+     *
+     * Cost: O(n / p)
+     */
+    template <typename Func>
+    void parallel_for_each(Func f, TreapTaskPool &pool = TreapTaskPool::instance()) const {
+      forEachNode(this->root.get(), f, pool);
+    }
+
+    /**
+     * Returns op(init, transform(e1), ..., transform(en)), with the
+     * elements combined in sorted order but grouped arbitrarily, so
+     * 'op' must be associative (but needn't be commutative).
+     * transform() and op() may be called concurrently on threads of
+     * 'pool'.
+     *
+     * Cost: O(n / p)
+     */
+    template <typename R, typename Op, typename Transform>
+    R transform_reduce(R init, Op op, Transform transform,
+                       TreapTaskPool &pool = TreapTaskPool::instance()) const {
+      if (!this->root) return init;
+      return op(std::move(init),
+                transformReduceNode<R>(this->root.get(), op, transform, pool));
+    }
+
+    /**
+     * transform_reduce() of the elements themselves.
+     */
+    template <typename R, typename Op>
+    R reduce(R init, Op op, TreapTaskPool &pool = TreapTaskPool::instance()) const {
+      return this->transform_reduce(std::move(init), op,
+                                    [](T const &data) -> T const& { return data; }, pool);
+    }
+
+    /**
+     * The number of elements for which pred(element) is true. 'pred'
+     * may be called concurrently.
+     *
+     * Cost: O(n / p)
+     */
+    template <typename Pred>
+    size_t count_if(Pred pred, TreapTaskPool &pool = TreapTaskPool::instance()) const {
+      return this->transform_reduce(size_t(0), std::plus<size_t>(),
+                                    [&pred](T const &data) -> size_t {
+                                      return pred(data) ? 1 : 0;
+                                    }, pool);
+    }
+
+    /**
+     * Returns a treap with the elements for which pred(element) is
+     * true. Subtrees in which every element is kept are shared with
+     * this treap. 'pred' may be called concurrently.
+     *
+     * Cost: O(n / p)
+     */
+    template <typename Pred>
+    Treap filter(Pred pred, TreapTaskPool &pool = TreapTaskPool::instance()) const {
+      return Treap(filterNode(this->root, pred, pool));
+    }
+
+    iterator begin() const {
+      typename iterator::PtrsType ptrs;
+      NodeType const *tmp = this->root.get();
+      while (tmp) {
+        ptrs.push_back(tmp);
+        tmp = tmp->left.get();
+      }
+      return iterator(std::move(ptrs), this->root.get());
+    }
+
+    iterator end() const {
+      return iterator(typename iterator::PtrsType(), this->root.get());
+    }
+
+  };
+
+  /**
+   * A batch-mutable builder for a Treap. Obtain one using
+   * Treap::transient(), apply a burst of insert/erase/update
+   * operations, and call persistent() to get an immutable Treap back.
+   *
+   * Unlike the Treap operations, these mutate the nodes owned
+   * exclusively by this builder in place instead of copying the root
+   * to node path on every operation. A node is owned exclusively if
+   * its reference count is 1 and its parent is owned exclusively.
+   * Nodes that are shared with any other version (including the
+   * version that this was created from, or versions returned by
+   * persistent()) are copied on first touch, so no other version is
+   * ever affected.
+   *
+   * A TransientTreap must not be used from multiple threads
+   * concurrently.
+   */
+  template <typename T, typename LessThan=std::less<T>,
+            typename Alloc=std::allocator<T>,
+            typename Summary=TreapNoSummary,
+            typename Layout=TreapDefaultLayout,
+            typename Priority=TreapRandomPriority>
+  class TransientTreap {
+    typedef Treap<T, LessThan, Alloc, Summary, Layout, Priority> TreapType;
+    typedef TreapCountingCompare<LessThan> KeyCompare;
+    typedef TreapNode<T, Alloc, Summary, Layout> NodeType;
+    typedef typename NodeType::NodePtrType NodePtrType;
+    NodePtrType root;
+    // Scratch space for the path of slots from the root, so that we
+    // don't allocate on every call.
+    std::vector<NodePtrType*> slots;
+
+    friend class Treap<T, LessThan, Alloc, Summary, Layout, Priority>;
+
+    explicit TransientTreap(TreapType const &treap)
+      : root(treap.root) { }
+
+    /**
+     * Rotate the child in 'slot' (a child pointer of the node held in
+     * 'parentSlot') up into 'parentSlot'. Both nodes must be owned
+     * exclusively.
+     */
+    static void rotateUp(NodePtrType &parentSlot, NodePtrType &slot) {
+      TREAP_STATS_ADD(rotations, 1);
+      NodePtrType parent = std::move(parentSlot);
+      NodePtrType node = std::move(slot);
+      if (&slot == &parent->left) {
+        parent->left = std::move(node->right);
+        parent->update();
+        node->right = std::move(parent);
+      } else {
+        parent->right = std::move(node->left);
+        parent->update();
+        node->left = std::move(parent);
+      }
+      node->update();
+      parentSlot = std::move(node);
+    }
+
+    /**
+     * Returns the node with KEY == key, or nullptr. Does not modify
+     * anything.
+     */
+    NodeType* findNode(T const &key) const {
+      KeyCompare lt;
+      NodeType *tmp = this->root.get();
+      while (tmp) {
+        TREAP_STATS_ADD(pathNodes, 1);
+        if (lt(key, tmp->data)) {
+          tmp = tmp->left.get();
+        } else if (lt(tmp->data, key)) {
+          tmp = tmp->right.get();
+        } else {
+          return tmp;
+        }
+      }
+      return nullptr;
+    }
+
+    /**
+     * Returns the slot holding the first found node with KEY ==
+     * key. Every node on the path from the root to that node
+     * (inclusive) is made exclusively owned, and the slots of the
+     * nodes above it are left in 'slots' for updateSlots().
+     *
+     * Precondition: A node with KEY == key exists.
+     */
+    NodePtrType& uniquePathTo(T const &key) {
+      KeyCompare lt;
+      this->slots.clear();
+      NodePtrType *slot = &this->root;
+      while (true) {
+        TREAP_STATS_ADD(pathNodes, 1);
+        NodeType *n = NodeType::makeUnique(*slot);
+        if (lt(key, n->data)) {
+          this->slots.push_back(slot);
+          slot = &n->left;
+        } else if (lt(n->data, key)) {
+          this->slots.push_back(slot);
+          slot = &n->right;
+        } else {
+          return *slot;
+        }
+      }
+    }
+
+    /**
+     * Update the nodes in the first 'count' entries of 'slots',
+     * bottom-up.
+     */
+    void updateSlots(size_t count) {
+      while (count > 0) {
+        (*this->slots[--count])->update();
+      }
+    }
+
+  public:
+    TransientTreap() { }
+
+    size_t size() const {
+      return this->root ? this->root->subtreeSize : 0;
+    }
+
+    bool empty() const {
+      return this->root ? false : true;
+    }
+
+    bool exists(T const &key) const {
+      return this->findNode(key) != nullptr;
+    }
+
+    /**
+     * Cost: O(log n)
+     */
+    TransientTreap& insert(T const &data) {
+      TREAP_STATS_SCOPE(INSERT);
+      NodePtrType node = NodeType::create(data, Priority()(data), 1);
+      KeyCompare lt;
+      this->slots.clear();
+      NodePtrType *slot = &this->root;
+      while (*slot) {
+        TREAP_STATS_ADD(pathNodes, 1);
+        NodeType *n = NodeType::makeUnique(*slot);
+        this->slots.push_back(slot);
+        slot = lt(data, n->data) ? &n->left : &n->right;
+      }
+      *slot = std::move(node);
+      this->slots.push_back(slot);
+
+      size_t ptrx = this->slots.size() - 1;
+      while (ptrx > 0 &&
+             (*this->slots[ptrx])->heapKey < (*this->slots[ptrx - 1])->heapKey) {
+        rotateUp(*this->slots[ptrx - 1], *this->slots[ptrx]);
+        --ptrx;
+      }
+      // The new node is in slots[ptrx].
+      this->updateSlots(ptrx);
+      return *this;
+    }
+
+    /**
+     * Erases the first found element with KEY == key, if any.
+     *
+     * Cost: O(log n)
+     */
+    TransientTreap& erase(T const &key) {
+      TREAP_STATS_SCOPE(ERASE);
+      if (!this->findNode(key)) {
+        return *this;
+      }
+      NodePtrType &slot = this->uniquePathTo(key);
+      NodePtrType left = std::move(slot->left);
+      NodePtrType right = std::move(slot->right);
+      slot = TreapType::joinOwned(std::move(left), std::move(right));
+      this->updateSlots(this->slots.size());
+      return *this;
     }
 
-    bool operator==(TreapIterator const &rhs) const {
-      return this->ptrs == rhs.ptrs && this->root == rhs.root;
+    /**
+     * Replace oldKey with newKey. Same semantics as Treap::update().
+     *
+     * Cost: O(log n)
+     */
+    TransientTreap& update(T const &oldKey, T const &newKey) {
+      TREAP_STATS_SCOPE(UPDATE);
+      assert(!KeyCompare()(oldKey, newKey) && !KeyCompare()(newKey, oldKey));
+      if (!this->findNode(oldKey)) {
+        return *this;
+      }
+      NodePtrType &slot = this->uniquePathTo(oldKey);
+      slot->data = newKey;
+      // newKey may have a different summary.
+      slot->update();
+      this->updateSlots(this->slots.size());
+      return *this;
     }
 
-    bool operator!=(TreapIterator const &rhs) const {
-      return !(*this == rhs);
+    /**
+     * Returns an immutable Treap with the current contents. This
+     * builder may continue to be used. Nodes shared with the returned
+     * Treap will be copied when touched next.
+     *
+     * Cost: O(1)
+     */
+    TreapType persistent() const {
+      return TreapType(this->root);
     }
-
   };
 
   /**
-   * This is an implementation of a functional treap data
-   * structure. Every mutating operation (insert/delete/update)
-   * doesn't mutate the existing treap, but instead returns a new copy
-   * of the treap, with the mutation applied. This means that every
-   * mutating operation on a treap *must* capture the return value
-   * since that is the latest version of the treap.
-   *
-   * Since no existing version is mutated, it is entirely safe to
-   * perform operations concurrently on your copy of the treap from
-   * multiple threads. A treap internally holds an std::shared_ptr<>
-   * to the root node. This automatically reclaims memory for unused
-   * (past) versions of the treap, so memory management isn't an
-   * issue.
-   *
-   * This treap also provides _random access iterators_ (you heard
-   * that right!) that cost O(log n) per random
-   * increment/decrement. Incrementing using operator++/-- is O(1)
-   * amortized, but incrementing/decrementing by 1 using operator+=/-=
-   * is not (and costs O(log n) per increment/decrement). This is a
-   * design decision. Using the random access iterator, you can
-   * (quickly) perform operations like computing the number of
-   * elements between 2 given iterators.
+   * A persistent map from unique keys of type K to values of type
+   * V. Like Treap, every mutating operation returns a new version and
+   * leaves this one unmodified. Entries are stored as std::pair<K, V>
+   * in treap nodes ordered by LessThan on the key.
    *
+   * Lookups descend from the root comparing keys directly, without
+   * building an iterator. If LessThan has a nested 'is_transparent'
+   * type, the lookup functions also accept any type that LessThan
+   * can compare with K, without converting it to a K first.
    */
-  template <typename T, typename LessThan=std::less<T> >
-  class Treap {
-    typedef TreapNode<T> NodeType;
-    typedef std::shared_ptr<NodeType> NodePtrType;
-    mutable NodePtrType root;
-    unsigned int seed;
-
+  template <typename K, typename V, typename LessThan=std::less<K>,
+            typename Alloc=std::allocator<std::pair<K, V> > >
+  class PersistentMap {
   public:
-    typedef TreapIterator<T, LessThan> iterator;
-    typedef TreapIterator<T, LessThan> const_iterator;
-    typedef T value_type;
+    typedef K key_type;
+    typedef V mapped_type;
+    typedef std::pair<K, V> value_type;
 
   private:
-    /**
-     * Inserts a new node 'node' into the tree rooted at this->root,
-     * and returns a pointer to the new root. The existing tree is
-     * un-modified, and a new root to node path is created. Nodes that
-     * are unchanged are shared between the older and the newer tree.
-     *
-     */
-    NodePtrType insertNode(NodePtrType node) const {
-      if (!root.get()) {
-        return node;
+    struct EntryLess {
+      bool operator()(value_type const &lhs, value_type const &rhs) const {
+        return LessThan()(lhs.first, rhs.first);
       }
-      LessThan lt;
-      NodePtrType tmp = root;
-      std::vector<NodePtrType> ptrs;
-      ChildDirection dirn = ChildDirection::LEFT;
-      std::vector<ChildDirection> dirns;
+    };
+
+    typedef Treap<value_type, EntryLess, Alloc> TreapType;
+    typedef typename TreapType::NodeType NodeType;
+    typedef typename NodeType::NodePtrType NodePtrType;
+    typedef TreapCountingCompare<LessThan> KeyCompare;
+
+    TreapType entries;
+
+    explicit PersistentMap(TreapType const &_entries) : entries(_entries) { }
+
+    template <typename Key>
+    NodeType const* findNode(Key const &key) const {
+      TREAP_STATS_SCOPE(LOOKUP);
+      KeyCompare lt;
+      NodeType const *tmp = this->entries.root.get();
       while (tmp) {
-        ptrs.push_back(tmp->clone());
-        ptrs.back()->subtreeSize++;
-        dirns.push_back(dirn);
-        if (lt(node->data, tmp->data)) {
-          dirn = ChildDirection::LEFT;
-          tmp = tmp->left;
+        TREAP_STATS_ADD(pathNodes, 1);
+        if (lt(key, tmp->data.first)) {
+          tmp = tmp->left.get();
+        } else if (lt(tmp->data.first, key)) {
+          tmp = tmp->right.get();
         } else {
-          dirn = ChildDirection::RIGHT;
-          tmp = tmp->right;
+          return tmp;
         }
       }
-      tmp = ptrs.back();
-      if (lt(node->data, tmp->data)) {
-        dirns.push_back(ChildDirection::LEFT);
-        tmp->left = node;
-      } else {
-        dirns.push_back(ChildDirection::RIGHT);
-        tmp->right = node;
-      }
-      ptrs.push_back(node);
+      return nullptr;
+    }
 
-      for (size_t i = 1; i < ptrs.size(); ++i) {
-        if (dirns[i] == ChildDirection::LEFT) {
-          ptrs[i-1]->left = ptrs[i];
+    /**
+     * Returns a copy of the entries with the value of 'key' (which
+     * must exist) replaced by 'value'. Only the root to node path is
+     * copied.
+     */
+    TreapType replaced(K const &key, V const &value) const {
+      KeyCompare lt;
+      TreapType result(this->entries);
+      result.root = result.root->clone();
+      NodeType *n = result.root.get();
+      while (true) {
+        TREAP_STATS_ADD(pathNodes, 1);
+        if (lt(key, n->data.first)) {
+          n->left = n->left->clone();
+          n = n->left.get();
+        } else if (lt(n->data.first, key)) {
+          n->right = n->right->clone();
+          n = n->right.get();
         } else {
-          ptrs[i-1]->right = ptrs[i];
+          n->data.second = value;
+          return result;
         }
       }
-
-      size_t ptrx = ptrs.size() - 1;
-      // While we have node, parent, grand-parent (i.e. at least 3
-      // nodes).
-      while (ptrx > 1 && ptrs[ptrx]->heapKey < ptrs[ptrx - 1]->heapKey) {
-        rotateUp(ptrs[ptrx], ptrs[ptrx - 1], ptrs[ptrx - 2]);
-        --ptrx;
-      }
-      assert(ptrx > 0);
-      if (ptrs[ptrx]->heapKey < ptrs[ptrx - 1]->heapKey) {
-        NodePtrType grandParent;
-        rotateUp(ptrs[ptrx], ptrs[ptrx - 1], grandParent);
-      }
-      return ptrs[0];
     }
 
     /**
-     * Inserts a new node 'node' into the tree rooted at this->root,
-     * and returns a pointer to the new root. The existing tree is
-     * *modified*.
-     *
+     * Returns a copy of the entries without 'key' (which must
+     * exist). The path to its node is copied, and the node is
+     * replaced by the join of its children.
      */
-    NodePtrType insertNodeNoClone(NodePtrType node) const {
-      if (!root.get()) {
-        return node;
-      }
-      LessThan lt;
-      NodePtrType tmp = root;
-      std::vector<NodePtrType> ptrs;
-      while (tmp) {
-        ptrs.push_back(tmp);
-        ptrs.back()->subtreeSize++;
-        if (lt(node->data, tmp->data)) {
-          tmp = tmp->left;
+    TreapType erased(K const &key) const {
+      KeyCompare lt;
+      TreapType result(this->entries);
+      TreapNodeStack<NodeType> path;
+      NodePtrType *slot = &result.root;
+      while (true) {
+        TREAP_STATS_ADD(pathNodes, 1);
+        NodeType const *tmp = slot->get();
+        if (lt(key, tmp->data.first)) {
+          *slot = tmp->clone();
+          path.push_back(slot->get());
+          slot = &(*slot)->left;
+        } else if (lt(tmp->data.first, key)) {
+          *slot = tmp->clone();
+          path.push_back(slot->get());
+          slot = &(*slot)->right;
         } else {
-          tmp = tmp->right;
+          *slot = TreapType::joinNodes(tmp->left, tmp->right);
+          break;
         }
       }
-      tmp = ptrs.back();
-      if (lt(node->data, tmp->data)) {
-        tmp->left = node;
-      } else {
-        tmp->right = node;
+      for (size_t i = path.size(); i > 0; --i) {
+        path[i - 1]->update();
       }
-      ptrs.push_back(node);
+      return result;
+    }
 
-      size_t ptrx = ptrs.size() - 1;
-      // While we have node, parent, grand-parent (i.e. at least 3
-      // nodes).
-      while (ptrx > 1 && ptrs[ptrx]->heapKey < ptrs[ptrx - 1]->heapKey) {
-        rotateUp(ptrs[ptrx], ptrs[ptrx - 1], ptrs[ptrx - 2]);
-        --ptrx;
+    template <typename Key>
+    V const& atImpl(Key const &key) const {
+      NodeType const *node = this->findNode(key);
+      if (!node) {
+        throw std::out_of_range("PersistentMap::at: key not found");
       }
-      assert(ptrx > 0);
-      if (ptrs[ptrx]->heapKey < ptrs[ptrx - 1]->heapKey) {
-        NodePtrType grandParent;
-        rotateUp(ptrs[ptrx], ptrs[ptrx - 1], grandParent);
+      return node->data.second;
+    }
+
+    template <typename Key>
+    V const* getImpl(Key const &key) const {
+      NodeType const *node = this->findNode(key);
+      return node ? &node->data.second : nullptr;
+    }
+
+  public:
+    typedef typename TreapType::iterator iterator;
+    typedef typename TreapType::const_iterator const_iterator;
+
+    PersistentMap() { }
+
+    size_t size() const {
+      return this->entries.size();
+    }
+
+    bool empty() const {
+      return this->entries.empty();
+    }
+
+    /**
+     * Returns the value mapped to 'key'. Throws std::out_of_range if
+     * there is none.
+     *
+     * Cost: O(log n)
+     */
+    V const& at(K const &key) const {
+      return this->atImpl(key);
+    }
+
+    template <typename Key, typename L = LessThan,
+              typename = typename L::is_transparent>
+    V const& at(Key const &key) const {
+      return this->atImpl(key);
+    }
+
+    /**
+     * Returns a pointer to the value mapped to 'key', or nullptr if
+     * there is none. The pointer is valid as long as this version is
+     * alive.
+     *
+     * Cost: O(log n)
+     */
+    V const* get(K const &key) const {
+      return this->getImpl(key);
+    }
+
+    template <typename Key, typename L = LessThan,
+              typename = typename L::is_transparent>
+    V const* get(Key const &key) const {
+      return this->getImpl(key);
+    }
+
+    bool contains(K const &key) const {
+      return this->findNode(key) != nullptr;
+    }
+
+    template <typename Key, typename L = LessThan,
+              typename = typename L::is_transparent>
+    bool contains(Key const &key) const {
+      return this->findNode(key) != nullptr;
+    }
+
+    /**
+     * Returns a new map with the value of 'key' replaced by 'value',
+     * or this map if 'key' isn't present.
+     *
+     * Cost: O(log n)
+     */
+    PersistentMap assign(K const &key, V const &value) const {
+      TREAP_STATS_SCOPE(UPDATE);
+      if (!this->findNode(key)) {
+        return *this;
       }
-      return ptrs[0];
+      return PersistentMap(this->replaced(key, value));
     }
 
     /**
-     * Clone the path present in 'ptrs' and return a list of cloned
-     * nodes with their left and right pointers set to the new nodes
-     * (if appropriate).
+     * Returns a new map with 'key' mapped to 'value', whether or not
+     * 'key' was present.
      *
+     * Cost: O(log n)
      */
-    std::vector<NodePtrType>
-    clonePtrs(std::vector<NodePtrType> const &ptrs) const {
-      std::vector<NodePtrType> clonedPtrs;
-      assert(!ptrs.empty());
-      clonedPtrs.reserve(ptrs.size());
-      clonedPtrs.push_back(ptrs[0]->clone());
-      for (size_t i = 1; i < ptrs.size(); ++i) {
-        clonedPtrs.push_back(ptrs[i]->clone());
-        if (ptrs[i]->isLeftChildOf(ptrs[i-1])) {
-          clonedPtrs[i-1]->left = clonedPtrs[i];
-        } else {
-          clonedPtrs[i-1]->right = clonedPtrs[i];
-        }
+    PersistentMap upsert(K const &key, V const &value) const {
+      TREAP_STATS_SCOPE(INSERT);
+      if (this->findNode(key)) {
+        return PersistentMap(this->replaced(key, value));
       }
-      return clonedPtrs;
+      return PersistentMap(this->entries.insert(value_type(key, value)));
     }
 
     /**
-     * Delete the current tree's root node and return a pointer to the
-     * new root node. Uses path copying to copy the root ro node path,
-     * and the older tree remains unmodified.
+     * Returns a new map without 'key', or this map if 'key' isn't
+     * present.
      *
+     * Cost: O(log n)
      */
-    NodePtrType deleteRootNode() const {
-      auto newRoot = this->root;
-      if (!newRoot->right) {
-        newRoot = newRoot->left;
-      } else if (!newRoot->left) {
-        newRoot = newRoot->right;
-      } else {
-        newRoot = this->root->clone();
-        auto leftChild = newRoot->left;
-        newRoot->left = nullptr;
-        auto rightChild = newRoot->right;
-        Treap t(rightChild);
-        auto parts = t.deleteAndGetBegin();
-        parts.first->left = leftChild;
-        parts.first->right = parts.second;
-        newRoot = parts.first;
-        // Set subtreeSize and heapKey for 'newRoot'
-        newRoot->subtreeSize = this->root->subtreeSize - 1;
-        newRoot->heapKey = this->root->heapKey;
+    PersistentMap erase(K const &key) const {
+      TREAP_STATS_SCOPE(ERASE);
+      if (!this->findNode(key)) {
+        return *this;
       }
-      return newRoot;
+      return PersistentMap(this->erased(key));
     }
 
-    std::pair<NodePtrType /* begin */, NodePtrType /* rest */>
-    deleteAndGetBegin() const {
-      auto first = this->begin();
-      auto ptrs = first.getRootToNodePtrs();
-      auto succPtr = ptrs.back()->clone();
-      succPtr->subtreeSize = 1;
-      succPtr->left = succPtr->right = nullptr;
-      auto newRoot = this->deleteIterator(first);
-      return std::make_pair(succPtr, newRoot);
+    /**
+     * Iterates over the entries in key order.
+     */
+    iterator begin() const {
+      return this->entries.begin();
     }
 
-    NodePtrType deleteIterator(iterator const &it) const {
-      auto ptrs = this->clonePtrs(it.getRootToNodePtrs());
-      assert(!ptrs.empty());
+    iterator end() const {
+      return this->entries.end();
+    }
+  };
+
+  /**
+   * Exponential backoff for retry loops: spins for twice as long on
+   * every call, and yields the CPU once spinning gets too long.
+   */
+  class TreapBackoff {
+    unsigned int spins;
+
+  public:
+    TreapBackoff() : spins(1) { }
 
-      if (ptrs.size() == 1) { // Delete the root node
-        return this->deleteRootNode();
+    void pause() {
+      if (this->spins > 1024) {
+        std::this_thread::yield();
+        return;
       }
+      for (unsigned int i = 0; i < this->spins; ++i) {
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+      }
+      this->spins *= 2;
+    }
+  };
+
+  /**
+   * Holds the current version of a treap that several threads read
+   * and update. load() and compare_exchange() are lock-free, so
+   * readers never wait for writers or for each other.
+   *
+   * The root pointer and a count of the loads made through it share
+   * a single 64-bit word: the pointer is in the low 48 bits and the
+   * count in the high 16 bits. When a version is published, PREPAID
+   * references to its root are taken up front. A load claims one of
+   * them with a compare-and-swap on the word, and every load that
+   * finds them half used or more tries to replenish them. A load
+   * never claims more than PREPAID of them: if they are all claimed
+   * (which takes PREPAID / 2 loads completing while every replenish
+   * among them is delayed), it waits for a replenish or a new
+   * version. When the version is replaced, the references that were
+   * not claimed are dropped. Since the accounting is per node, this
+   * stays correct even if the same root is published again (ABA).
+   *
+   * Requires user space pointers to fit in 48 bits (true on x86-64
+   * and AArch64).
+   */
+  template <typename T, typename LessThan=std::less<T>,
+            typename Alloc=std::allocator<T>,
+            typename Summary=TreapNoSummary,
+            typename Layout=TreapDefaultLayout,
+            typename Priority=TreapRandomPriority>
+  class AtomicTreap {
+  public:
+    typedef Treap<T, LessThan, Alloc, Summary, Layout, Priority> TreapType;
+
+    enum UpdatePolicy {
+      // Retry a failed update immediately.
+      RETRY,
+      // Back off exponentially between retries of a failed update.
+      BACKOFF,
+      // Queue updates. Whichever updating thread gets there first
+      // applies all the queued updates in order and publishes the
+      // result with a single compare-and-swap, while the others
+      // wait for their result.
+      COMBINE
+    };
+
+  private:
+    typedef typename TreapType::NodeType NodeType;
+    typedef typename TreapType::NodePtrType NodePtrType;
+
+    // Dependent, so that only 32-bit builds using AtomicTreap fail.
+    static_assert(sizeof(NodeType*) == sizeof(uint64_t),
+                  "AtomicTreap needs 64-bit pointers");
+
+    static const int COUNT_SHIFT = 48;
+    static const uint64_t ONE_LOAD = uint64_t(1) << COUNT_SHIFT;
+    static const uint64_t POINTER_MASK = ONE_LOAD - 1;
+    static const unsigned int PREPAID = 1u << 15;
+
+    struct Request {
+      TreapType (*apply)(void *func, TreapType const &current);
+      void *func;
+      TreapType result;
+      std::exception_ptr error;
+      Request *next;
+      std::atomic<bool> done;
+
+      Request() : next(nullptr), done(false) { }
+    };
+
+    // Loads update the count in 'word'.
+    mutable std::atomic<uint64_t> word;
+    const UpdatePolicy policy;
+    // Updates waiting to be applied by a combiner (newest first).
+    std::atomic<Request*> pending;
+    std::atomic<bool> combinerBusy;
+
+    static NodeType* pointerOf(uint64_t w) {
+      return reinterpret_cast<NodeType*>(static_cast<uintptr_t>(w & POINTER_MASK));
+    }
+
+    static unsigned int loadsOf(uint64_t w) {
+      return static_cast<unsigned int>(w >> COUNT_SHIFT);
+    }
+
+    /**
+     * Takes the PREPAID references to 'node' needed to publish it.
+     */
+    static uint64_t prepay(NodeType *node) {
+      const uint64_t bits = static_cast<uint64_t>(reinterpret_cast<uintptr_t>(node));
+      assert((bits & ~POINTER_MASK) == 0);
+      if (node) node->refs.acquire(PREPAID);
+      return bits;
+    }
 
-      for (auto &ptr : ptrs) {
-        ptr->subtreeSize--;
+    /**
+     * Drops the references prepaid for 'node' that were not claimed
+     * by the 'loads' loads made while it was published.
+     */
+    static void releaseUnclaimed(NodeType *node, unsigned int loads) {
+      if (node && node->refs.release(PREPAID - loads)) {
+        NodeType::destroy(node);
       }
+    }
 
-      auto parPtr = ptrs[ptrs.size() - 2];
-      auto delPtr = ptrs[ptrs.size() - 1];
-      if (!delPtr->left || !delPtr->right) {
-        if (!delPtr->left) {
-          if (delPtr->isLeftChildOf(parPtr)) {
-            parPtr->left = delPtr->right;
-          } else {
-            parPtr->right = delPtr->right;
-          }
-        } else {
-          if (delPtr->isLeftChildOf(parPtr)) {
-            parPtr->left = delPtr->left;
-          } else {
-            parPtr->right = delPtr->left;
-          }
-        }
-      } else {
-        // Has both child nodes.
-        Treap t(delPtr->right);
-        auto parts = t.deleteAndGetBegin();
-        auto succPtr = parts.first;
-        auto newRoot = parts.second;
-
-        succPtr->left = delPtr->left;
-        succPtr->right = newRoot;
-        succPtr->subtreeSize = (succPtr->left ? succPtr->left->subtreeSize : 0) +
-          (succPtr->right ? succPtr->right->subtreeSize : 0) + 1;
-
-        // succPtr->heapKey is to be set to the previous heap key of
-        // the deleted node. This means that we don't need to perform
-        // any more rotations to restore the heap property.
-        succPtr->heapKey = delPtr->heapKey;
-
-        if (delPtr->isLeftChildOf(parPtr)) {
-          parPtr->left = succPtr;
-        } else {
-          parPtr->right = succPtr;
+    /**
+     * Prepays 'loads' more references to 'node' if it is still
+     * published, so that more loads can claim them.
+     */
+    void replenish(NodeType *node, unsigned int loads) const {
+      if (node) node->refs.acquire(loads);
+      uint64_t w = this->word.load(std::memory_order_relaxed);
+      while (pointerOf(w) == node && loadsOf(w) >= loads) {
+        if (this->word.compare_exchange_weak(w, w - loads * ONE_LOAD,
+                                             std::memory_order_relaxed)) {
+          return;
         }
-        // No need to update parPtr->subtreeSize since it has already
-        // been decremented by 1.
       }
-      return ptrs[0];
+      // Replaced (or already replenished) in the meantime. We hold a
+      // reference, so this can't drop the last one.
+      if (node) node->refs.release(loads);
     }
 
-    NodePtrType deleteKey(T const &key) const {
-      LessThan lt;
-      auto keyIt = this->lower_bound(key);
-      if (keyIt == this->end()) {
-        return this->root;
+    template <typename Func>
+    static TreapType applyFunc(void *func, TreapType const &current) {
+      return (*static_cast<Func*>(func))(current);
+    }
+
+    /**
+     * Applies every queued request to the current version, and
+     * publishes the result.
+     */
+    void combine() {
+      Request *newest = this->pending.exchange(nullptr, std::memory_order_acquire);
+      if (!newest) return;
+      std::vector<Request*> batch;
+      for (Request *r = newest; r; r = r->next) {
+        batch.push_back(r);
       }
-      if (!lt(key, *keyIt) && !lt(*keyIt, key)) { // key == *keyIt
-        return this->deleteIterator(keyIt);
+      std::reverse(batch.begin(), batch.end());
+
+      TreapType current = this->load();
+      while (true) {
+        TreapType next = current;
+        for (Request *r : batch) {
+          try {
+            next = r->apply(r->func, next);
+            r->result = next;
+            r->error = nullptr;
+          } catch (...) {
+            r->error = std::current_exception();
+          }
+        }
+        if (this->compare_exchange(current, next)) break;
+      }
+      for (Request *r : batch) {
+        r->done.store(true, std::memory_order_release);
       }
-      return this->root;
     }
 
     template <typename Func>
-    void levelorder(NodePtrType n, Func f) const {
-      if (!n.get()) return;
-      std::queue<NodePtrType> q;
-      q.push(n);
-      while (!q.empty()) {
-        auto top = q.front();
-        q.pop();
-        if (top->left) q.push(top->left);
-        if (top->right) q.push(top->right);
-        f(top->data, top);
+    TreapType updateCombining(Func &fn) {
+      Request request;
+      request.apply = &applyFunc<Func>;
+      request.func = &fn;
+      request.next = this->pending.load(std::memory_order_relaxed);
+      while (!this->pending.compare_exchange_weak(request.next, &request,
+                                                  std::memory_order_release,
+                                                  std::memory_order_relaxed)) { }
+
+      TreapBackoff backoff;
+      while (!request.done.load(std::memory_order_acquire)) {
+        if (!this->combinerBusy.exchange(true, std::memory_order_acquire)) {
+          this->combine();
+          this->combinerBusy.store(false, std::memory_order_release);
+        } else {
+          backoff.pause();
+        }
       }
+      if (request.error) std::rethrow_exception(request.error);
+      return request.result;
     }
 
-    template <typename Func>
-    void inorder(NodePtrType n, Func f) const {
-      // std::cout << "n.get(): " << n.get() << endl;
-      if (!n.get()) return;
-      inorder(n->left, f);
-      f(n->data, n);
-      inorder(n->right, f);
-    }
+  public:
+    explicit AtomicTreap(TreapType const &initial = TreapType(),
+                         UpdatePolicy _policy = BACKOFF)
+      : word(prepay(initial.root.get())), policy(_policy),
+        pending(nullptr), combinerBusy(false) { }
 
-    Treap(NodePtrType _root) :
-      root(_root), seed(_treap_random_seed) { }
+    AtomicTreap(AtomicTreap const&) = delete;
+    AtomicTreap& operator=(AtomicTreap const&) = delete;
 
-    template <typename Iter>
-    void fillNodes(Iter first, Iter last,
-                   std::vector<NodePtrType> &nodes) const {
-      for (; first != last; ++first) {
-        nodes.push_back(std::make_shared<NodeType>(*first, 0, 1));
-      }
+    ~AtomicTreap() {
+      const uint64_t w = this->word.load(std::memory_order_acquire);
+      releaseUnclaimed(pointerOf(w), loadsOf(w));
     }
 
     /**
-     * Precondition: last - first > 0
+     * Returns the current version.
+     *
+     * Cost: O(1)
      */
-    template <typename Iter>
-    void assignSorted(Iter first, Iter last) {
-      std::vector<NodePtrType> allNodes;
-      this->fillNodes(first, last, allNodes);
+    TreapType load() const {
+      uint64_t w = this->word.load(std::memory_order_relaxed);
+      TreapBackoff backoff;
+      while (true) {
+        if (loadsOf(w) >= PREPAID) {
+          // Every prepaid reference is claimed, so the node may be
+          // gone by the time we'd take one of our own. Wait for a
+          // load that claimed one to replenish them.
+          backoff.pause();
+          w = this->word.load(std::memory_order_relaxed);
+        } else if (this->word.compare_exchange_weak(w, w + ONE_LOAD,
+                                                    std::memory_order_acquire,
+                                                    std::memory_order_relaxed)) {
+          break;
+        }
+      }
+      NodeType *node = pointerOf(w);
+      const unsigned int loads = loadsOf(w) + 1;
+      TreapType result(NodePtrType::adopt(node));
+      if (loads >= PREPAID / 2) {
+        this->replenish(node, loads);
+      }
+      return result;
+    }
 
-      std::vector<NodePtrType> nodes[2];
+    /**
+     * Publishes 'desired' as the current version.
+     */
+    void store(TreapType const &desired) {
+      const uint64_t w = this->word.exchange(prepay(desired.root.get()),
+                                             std::memory_order_acq_rel);
+      releaseUnclaimed(pointerOf(w), loadsOf(w));
+    }
 
-#define NODE_GET(IDX) ((IDX) < nodes[1].size() ? nodes[1][IDX] : nullptr)
-      size_t start = 1;
-      size_t hjump = 2;
-      while (nodes[0].size() != 1) {
-        nodes[0].swap(nodes[1]);
-        nodes[0].clear();
-        size_t ctr = 0;
-#if 0
-        fprintf(stderr, "New Set [start: %d] [hjump: %d]\n", start, hjump);
-#endif
+    /**
+     * Publishes 'desired' if the current version is still 'expected'
+     * (the same version, not just equal contents) and returns
+     * true. Otherwise loads the current version into 'expected' and
+     * returns false.
+     */
+    bool compare_exchange(TreapType &expected, TreapType const &desired) {
+      NodeType *desiredNode = desired.root.get();
+      const uint64_t desiredWord = prepay(desiredNode);
+      uint64_t w = this->word.load(std::memory_order_relaxed);
+      while (pointerOf(w) == expected.root.get()) {
+        if (this->word.compare_exchange_weak(w, desiredWord,
+                                             std::memory_order_acq_rel,
+                                             std::memory_order_relaxed)) {
+          releaseUnclaimed(pointerOf(w), loadsOf(w));
+          return true;
+        }
+      }
+      // 'desired' holds a reference, so this can't drop the last one.
+      if (desiredNode) desiredNode->refs.release(PREPAID);
+      expected = this->load();
+      return false;
+    }
 
-        for (size_t i = start - 1; i < allNodes.size(); i += hjump) {
-          auto &nn = allNodes[i];
-          nn->left = NODE_GET(ctr); ctr++;
-          nn->right = NODE_GET(ctr); ctr++;
-          nn->subtreeSize = (nn->left ? nn->left->subtreeSize : 0) +
-            (nn->right ? nn->right->subtreeSize : 0) + 1;
-          // cerr << nn->subtreeSize << ", ";
-          nodes[0].push_back(nn);
+    /**
+     * Atomically replaces the current version 'v' with fn(v), and
+     * returns the new version. 'fn' may be called more than once
+     * (with different versions), and from another thread that is
+     * updating at the same time if the policy is COMBINE, so it
+     * should have no side effects. If 'fn' throws, the exception
+     * is rethrown and nothing is published for this update.
+     */
+    template <typename Func>
+    TreapType update(Func fn) {
+      if (this->policy == COMBINE) {
+        return this->updateCombining(fn);
+      }
+      TreapType current = this->load();
+      TreapBackoff backoff;
+      while (true) {
+        TreapType next = fn(static_cast<TreapType const&>(current));
+        if (this->compare_exchange(current, next)) {
+          return next;
         }
-        // Copy residual nodes from nodes[1] to nodes[0].
-        while (ctr < nodes[1].size()) {
-          nodes[0].push_back(nodes[1][ctr++]);
+        if (this->policy == BACKOFF) {
+          backoff.pause();
         }
-        start *= 2;
-        hjump *= 2;
-        // cerr << std::endl;
       }
-#undef NODE_GET
-      this->root = nodes[0][0];
-      std::vector<int> allHeapKeys;
-      // Assign heap keys.
-      const int seed = 8271;
-      std::copy_n(RNGIterator(seed), this->size(),
-                  std::back_inserter(allHeapKeys));
-      std::transform(allHeapKeys.begin(), allHeapKeys.end(),
-                     allHeapKeys.begin(),
-                     [&] (int rno) { return rno % (this->size() * 12 + 1); });
-      std::sort(allHeapKeys.begin(), allHeapKeys.end());
-      auto heapKeysIt = allHeapKeys.begin();
-      this->levelorder(this->root, [&heapKeysIt] (T const&, NodePtrType &node) {
-          node->heapKey = *heapKeysIt;
-          ++heapKeysIt;
-        });
     }
+  };
 
+  /**
+   * Read-only access to a snapshot file written by Treap::save(),
+   * mapped into memory. Lookups and iteration are served directly
+   * from the mapped records, so opening a snapshot costs O(1) no
+   * matter how large it is, and only the pages that are touched are
+   * read from disk.
+   *
+   * The first call to treap() (or to any of the functions returning
+   * a modified version) rebuilds the saved tree as a regular Treap,
+   * in O(n), and caches it. Later modifications are path copies of
+   * the cached treap. The rebuilt treap doesn't share nodes with the
+   * mapping, so the first modification copies every node to the
+   * heap; call treap() ahead of time (e.g. on a background thread)
+   * to keep that off the critical path.
+   */
+  template <typename T, typename LessThan=std::less<T>,
+            typename Alloc=std::allocator<T>,
+            typename Summary=TreapNoSummary,
+            typename Layout=TreapDefaultLayout,
+            typename Priority=TreapRandomPriority>
+  class TreapSnapshot {
   public:
-    Treap() : seed(_treap_random_seed) { }
-    Treap(Treap const &rhs) {
-      this->root = rhs.root;
-      this->seed = rhs.seed;
+    typedef Treap<T, LessThan, Alloc, Summary, Layout, Priority> TreapType;
+    typedef TreapSnapshotRecord<T> Record;
+
+    /**
+     * A random access iterator over the mapped records, in sorted
+     * order.
+     */
+    class iterator : public std::iterator<std::random_access_iterator_tag, const T> {
+      Record const *record;
+
+    public:
+      iterator() : record(nullptr) { }
+      explicit iterator(Record const *_record) : record(_record) { }
+
+      T const& operator*() const { return this->record->data; }
+      const T* operator->() const { return &this->record->data; }
+      T const& operator[](off_t offset) const { return this->record[offset].data; }
+
+      iterator& operator++() { ++this->record; return *this; }
+      iterator& operator--() { --this->record; return *this; }
+      iterator operator++(int) { iterator ret = *this; ++this->record; return ret; }
+      iterator operator--(int) { iterator ret = *this; --this->record; return ret; }
+      iterator& operator+=(off_t offset) { this->record += offset; return *this; }
+      iterator& operator-=(off_t offset) { this->record -= offset; return *this; }
+      iterator operator+(off_t offset) const { return iterator(this->record + offset); }
+      iterator operator-(off_t offset) const { return iterator(this->record - offset); }
+      off_t operator-(iterator const &rhs) const { return this->record - rhs.record; }
+
+      bool operator==(iterator const &rhs) const { return this->record == rhs.record; }
+      bool operator!=(iterator const &rhs) const { return this->record != rhs.record; }
+      bool operator<(iterator const &rhs) const { return this->record < rhs.record; }
+    };
+    typedef iterator const_iterator;
+
+  private:
+    void *mapping;
+    size_t mappingSize;
+    TreapSnapshotHeader const *header;
+    Record const *records;
+    mutable std::mutex materializeMutex;
+    mutable TreapType materialized;
+    mutable bool isMaterialized;
+
+    void close() {
+      if (this->mapping) {
+        munmap(this->mapping, this->mappingSize);
+      }
+      this->mapping = nullptr;
+      this->mappingSize = 0;
+      this->header = nullptr;
+      this->records = nullptr;
+      this->materialized = TreapType();
+      this->isMaterialized = false;
     }
-    /* No MOVE semantics since this is an immutable data structure. */
-    Treap& operator=(Treap const &rhs) {
-      this->root = rhs.root;
-      this->seed = rhs.seed;
-      return *this;
+
+  public:
+    TreapSnapshot()
+      : mapping(nullptr), mappingSize(0), header(nullptr), records(nullptr),
+        isMaterialized(false) { }
+
+    TreapSnapshot(TreapSnapshot const&) = delete;
+    TreapSnapshot& operator=(TreapSnapshot const&) = delete;
+
+    ~TreapSnapshot() {
+      this->close();
     }
+
     /**
-     * Bulk load from a possibly sorted set.
+     * Map the snapshot file at 'path'. Returns false if it can't be
+     * mapped or isn't a valid snapshot of this type (in which case
+     * this snapshot is empty).
+     *
+     * Cost: O(1)
      */
-    template <typename Iter>
-    Treap(Iter first, Iter last) : seed(_treap_random_seed) {
-      // Do we have at least 2 elements?
-      if (first == last) return;
-      auto f = first;
-      ++f;
-      if (f == last) {
-        // Single element
-        const int heapKey = rand_r(&this->seed) % (12 + 1);
-        this->root = std::make_shared<NodeType>(*f, heapKey, 1);
-        return;
+    bool open(char const *path) {
+      this->close();
+      const int fd = ::open(path, O_RDONLY);
+      if (fd < 0) return false;
+      struct stat st;
+      if (fstat(fd, &st) != 0 ||
+          static_cast<size_t>(st.st_size) < sizeof(TreapSnapshotHeader)) {
+        ::close(fd);
+        return false;
       }
+      void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      ::close(fd);
+      if (addr == MAP_FAILED) return false;
+      this->mapping = addr;
+      this->mappingSize = st.st_size;
 
-      // Invariant: last - first > 1.
-      //
-      // Check if input range is sorted.
-      if (std::adjacent_find(first, last,
-                             [] (typename Iter::value_type const &lhs,
-                                 typename Iter::value_type const &rhs) {
-                               return LessThan()(rhs, lhs);
-                             }) != last) {
-        // Unsorted: O(n log n)
-        for (; first != last; ++first) {
-          const int heapKey = rand_r(&this->seed) % (this->size() * 12 + 1);
-          this->root = this->insertNodeNoClone(std::make_shared<NodeType>(*first, heapKey, 1));
-        }
-      } else {
-        // Sorted: O(n)
-        this->assignSorted(first, last);
+      TreapSnapshotHeader const *h = static_cast<TreapSnapshotHeader const*>(addr);
+      const size_t available = (this->mappingSize - sizeof(TreapSnapshotHeader)) / sizeof(Record);
+      if (!h->valid(sizeof(Record)) || h->count > available) {
+        this->close();
+        return false;
       }
+      this->header = h;
+      this->records = reinterpret_cast<Record const*>(
+        static_cast<char const*>(addr) + sizeof(TreapSnapshotHeader));
+      return true;
+    }
+
+    bool is_open() const {
+      return this->header != nullptr;
     }
 
     size_t size() const {
-      return this->root ? this->root->subtreeSize : 0;
+      return this->header ? this->header->count : 0;
     }
 
     bool empty() const {
-      return this->root ? false : true;
+      return this->size() == 0;
     }
 
-    Treap insert(T const &data) const {
-      Treap newTreap(*this);
-      auto _seed = this->seed;
-      const int heapKey = rand_r(&_seed) % (this->size() * 12 + 1);
-      newTreap.root = newTreap.insertNode(std::make_shared<NodeType>(data, heapKey, 1));
-      newTreap.seed = _seed;
-      return newTreap;
+    iterator begin() const {
+      return iterator(this->records);
     }
 
-    /**
-     * Erases the first found element with KEY == key. Returns a new
-     * treap with the element removed. The first found element isn't
-     * necessarily the first element inserted with KEY == key.
-     */
-    Treap erase(T const &key) const {
-      Treap newTreap(*this);
-      newTreap.root = newTreap.deleteKey(key);
-      return newTreap;
+    iterator end() const {
+      return iterator(this->records + this->size());
     }
 
     /**
-     * Erases the element pointed to by iterator 'it'. Returns a new
-     * treap with the element removed.
+     * Cost: O(log n)
      */
-    Treap erase(iterator const &it) const {
-      assert(it != this->end());
-      assert(it.root == this->root);
-      assert(this->root.get() != nullptr);
-      Treap newTreap(*this);
-      newTreap.root = newTreap.deleteIterator(it);
-      return newTreap;
+    iterator lower_bound(T const &key) const {
+      LessThan lt;
+      return std::lower_bound(this->begin(), this->end(), key, lt);
     }
 
-    /**
-     * Update the Treap and replace oldKey with newKey. It is assumed
-     * that newKey fits in *exactly* the same place as oldKey. If not,
-     * this will violate the BST properties.
-     */
-    Treap update(T const &oldKey, T const &newKey) const {
-      assert(!LessThan()(oldKey, newKey) && !LessThan()(newKey, oldKey));
-      auto it = this->find(oldKey);
-      if (it == this->end()) {
-        return *this;
-      }
-      auto ptrs = this->clonePtrs(it.getRootToNodePtrs());
-      ptrs.back()->data = newKey;
-      Treap newTreap(ptrs[0]);
-      return newTreap;
+    iterator upper_bound(T const &key) const {
+      LessThan lt;
+      return std::upper_bound(this->begin(), this->end(), key, lt);
     }
 
-    bool exists(T const &key) const {
-      NodePtrType tmp = root;
+    iterator find(T const &key) const {
       LessThan lt;
-      while (tmp) {
-        if (lt(key, tmp->data)) {
-          tmp = tmp->left;
-        } else if (lt(tmp->data, key)) {
-          tmp = tmp->right;
-        } else {
-          return true;
-        }
+      iterator it = this->lower_bound(key);
+      if (it != this->end() && !lt(key, *it)) {
+        return it;
       }
-      return false;
+      return this->end();
+    }
+
+    bool exists(T const &key) const {
+      return this->find(key) != this->end();
+    }
+
+    size_t count(T const &key) const {
+      return this->upper_bound(key) - this->lower_bound(key);
     }
 
     /**
-     * The first position before which we can insert 'key' and remain
-     * sorted.
+     * The snapshot as a regular treap, which may be modified (and
+     * shares no memory with the mapping). Built on the first call.
+     *
+     * open() only checks the header, so this is where corrupt
+     * records are found: throws std::runtime_error if they don't
+     * form a valid tree (and so do insert(), erase() and update()).
+     *
+     * Cost: O(n) the first time, O(1) afterwards.
      */
-    iterator lower_bound(T const &key) const {
-      NodePtrType tmp = root;
-      LessThan lt;
-      std::vector<NodePtrType> ptrs;
-      size_t capSize = 0;
-      while (tmp) {
-        ptrs.push_back(tmp);
-        if (!lt(tmp->data, key)) { // key <= tmp->data
-          capSize = ptrs.size();
-          tmp = tmp->left;
-        } else { // key > tmp->data
-          tmp = tmp->right;
+    TreapType treap() const {
+      std::lock_guard<std::mutex> lock(this->materializeMutex);
+      if (!this->isMaterialized && this->header) {
+        typename TreapType::NodePtrType root;
+        if (!TreapType::buildFromRecords(this->records, *this->header, root)) {
+          throw std::runtime_error("TreapSnapshot: corrupt snapshot records");
         }
+        this->materialized = TreapType(root);
+        this->isMaterialized = true;
       }
-      ptrs.resize(capSize);
-      return iterator(std::move(ptrs), this->root);
+      return this->materialized;
+    }
+
+    TreapType insert(T const &data) const {
+      return this->treap().insert(data);
     }
 
+    TreapType erase(T const &key) const {
+      return this->treap().erase(key);
+    }
+
+    TreapType update(T const &oldKey, T const &newKey) const {
+      return this->treap().update(oldKey, newKey);
+    }
+  };
+
+  /**
+   * Writes a log of the changes between successive versions of a
+   * treap, for replicas that already hold an earlier version (see
+   * TreapDeltaReplayer). Since every mutation path-copies, a version
+   * derived from the previously written one differs from it only by
+   * the nodes created by the mutations in between, usually O(log n)
+   * per mutation. A delta contains those nodes, referring to the
+   * nodes the replica already has by ID, so it costs O(k) to write
+   * and send, where k is the number of new nodes.
+   *
+   * The writer starts from a base version, which replicas must load
+   * from base.save(). It keeps the last written version alive (so
+   * that the addresses of its nodes can't be reused by new nodes)
+   * along with the ID of each of its nodes.
+   */
+  template <typename T, typename LessThan=std::less<T>,
+            typename Alloc=std::allocator<T>,
+            typename Summary=TreapNoSummary,
+            typename Layout=TreapDefaultLayout,
+            typename Priority=TreapRandomPriority>
+  class TreapDeltaWriter {
+  public:
+    typedef Treap<T, LessThan, Alloc, Summary, Layout, Priority> TreapType;
+    typedef TreapDeltaRecord<T> Record;
+
+  private:
+    typedef typename TreapType::NodeType NodeType;
+    typedef typename TreapType::NodePtrType NodePtrType;
+
+    TreapType current;
+    std::unordered_map<NodeType const*, uint64_t> ids;
+    uint64_t nextId;
+    uint64_t nextSequence;
+
     /**
-     * The last position before which we can insert 'key' and remain
-     * sorted.
+     * Pass the delta from this->current to 'version' to write(data,
+     * size) in consecutive pieces. The writer only moves on to
+     * 'version' if every write() succeeds.
      */
-    iterator upper_bound(T const &key) const {
-      NodePtrType tmp = root;
-      LessThan lt;
-      std::vector<NodePtrType> ptrs;
-      size_t capSize = 0;
-      while (tmp) {
-        ptrs.push_back(tmp);
-        if (lt(key, tmp->data)) { // key < tmp->data
-          capSize = ptrs.size();
-          tmp = tmp->left;
-        } else { // key >= tmp->data
-          tmp = tmp->right;
+    template <typename Write>
+    bool writeDelta(TreapType const &version, Write write) {
+      static_assert(std::is_trivially_copyable<T>::value,
+                    "Only treaps of trivially copyable elements can be logged");
+      const uint64_t NONE = TreapSnapshotHeader::NONE;
+      std::unordered_map<NodeType const*, uint64_t> fresh;
+      // Written nodes that are referenced by the new nodes (or are
+      // the new root). Their subtrees are shared with 'version'.
+      std::unordered_set<NodeType const*> reused;
+      auto isNew = [this, &reused](NodeType const *n) {
+        if (!n) return false;
+        if (this->ids.count(n)) {
+          reused.insert(n);
+          return false;
         }
+        return true;
+      };
+      auto idOf = [this, &fresh, NONE](NodePtrType const &n) -> uint64_t {
+        if (!n) return NONE;
+        auto it = fresh.find(n.get());
+        return it != fresh.end() ? it->second : this->ids.find(n.get())->second;
+      };
+
+      // Post-order traversal of the new nodes.
+      std::vector<Record> records;
+      std::vector<std::pair<NodeType const*, bool> > stack;
+      uint64_t id = this->nextId;
+      if (isNew(version.root.get())) {
+        stack.push_back(std::make_pair(version.root.get(), false));
+      }
+      while (!stack.empty()) {
+        NodeType const *n = stack.back().first;
+        if (!stack.back().second) {
+          stack.back().second = true;
+          if (isNew(n->right.get())) stack.push_back(std::make_pair(n->right.get(), false));
+          if (isNew(n->left.get())) stack.push_back(std::make_pair(n->left.get(), false));
+          continue;
+        }
+        stack.pop_back();
+        records.resize(records.size() + 1);
+        Record &record = records.back();
+        memset(&record, 0, sizeof(record));
+        memcpy(&record.data, &n->data, sizeof(T));
+        record.heapKey = n->heapKey;
+        record.id = id;
+        record.left = idOf(n->left);
+        record.right = idOf(n->right);
+        fresh[n] = id++;
       }
-      ptrs.resize(capSize);
-      return iterator(std::move(ptrs), this->root);
-    }
 
-    iterator find(T const &key) const {
-      iterator it = this->lower_bound(key);
-      LessThan lt;
-      if (!lt(key, *it) && !lt(*it, key)) {
-        return it;
+      // A written node that isn't reachable through a reused node is
+      // no longer part of the new version. A reused node's subtree
+      // is the same in both versions, so it can be skipped.
+      std::vector<uint64_t> dropped;
+      TreapType::walkNodes(this->current.root.get(), [this, &reused, &dropped](NodeType const *n) {
+          if (reused.count(n)) return false;
+          dropped.push_back(this->ids.find(n)->second);
+          return true;
+        });
+
+      TreapDeltaHeader header;
+      memset(&header, 0, sizeof(header));
+      memcpy(header.magic, TreapDeltaHeader::expectedMagic(), sizeof(header.magic));
+      header.byteOrder = TreapSnapshotHeader::expectedByteOrder();
+      header.recordSize = sizeof(Record);
+      header.sequence = this->nextSequence;
+      header.count = records.size();
+      header.dropped = dropped.size();
+      header.root = idOf(version.root);
+      header.size = version.size();
+      if (!write(&header, sizeof(header)) ||
+          (!records.empty() && !write(records.data(), records.size() * sizeof(Record))) ||
+          (!dropped.empty() && !write(dropped.data(), dropped.size() * sizeof(uint64_t)))) {
+        return false;
       }
-      return this->end();
+
+      TreapType::walkNodes(this->current.root.get(), [this, &reused](NodeType const *n) {
+          if (reused.count(n)) return false;
+          this->ids.erase(n);
+          return true;
+        });
+      this->ids.insert(fresh.begin(), fresh.end());
+      this->current = version;
+      this->nextId = id;
+      ++this->nextSequence;
+      return true;
     }
 
+  public:
     /**
-     * Count the number of elements with KEY == key.
-     *
-     * Complexity: O(log n)
+     * Start a log at 'base'. Its nodes get the IDs of their records
+     * in base.save().
      *
+     * Cost: O(n)
      */
-    size_t count(T const& key) const {
-      iterator first = this->lower_bound(key);
-      iterator last = this->upper_bound(key);
-      return last - first;
+    explicit TreapDeltaWriter(TreapType const &base)
+      : current(base), nextId(0), nextSequence(0) {
+      this->ids.reserve(base.size());
+      std::vector<NodeType const*> stack;
+      NodeType const *n = base.root.get();
+      while (n || !stack.empty()) {
+        for (; n; n = n->left.get()) {
+          stack.push_back(n);
+        }
+        n = stack.back();
+        stack.pop_back();
+        this->ids[n] = this->nextId++;
+        n = n->right.get();
+      }
     }
 
-    std::ostream& print(std::ostream &out) const {
-      this->for_each([&out](T const &data, NodePtrType node) {
-          out << data << ", ";
-        });
-      return out;
-    }
+    TreapDeltaWriter(TreapDeltaWriter const&) = delete;
+    TreapDeltaWriter& operator=(TreapDeltaWriter const&) = delete;
 
     /**
-     * Print a graphviz consumable tree representation of this
-     * treap. Values in parenthesis represent heap keys and
-     * subtree-sizes.
-     *
-     * Node format: Key(heapKey,subtreeSize)
+     * Write the delta from the last written version (initially the
+     * base) to 'version' to 'out'. 'version' is usually derived from
+     * the last written version, but doesn't have to be: nodes that
+     * aren't shared are simply written in full. If writing fails,
+     * the failbit of 'out' is set and the writer stays at the last
+     * written version, so the delta may be written again.
      *
+     * Cost: O(k), where k is the number of nodes in the delta.
      */
-    std::ostream& toDot(std::ostream &out) const {
-      out << "digraph Treap {\n";
-      this->for_each([&out](T const &data, NodePtrType node) {
-          std::ostringstream buff1, buff2, buff3;
-          buff1 << node->data << "(" << node->heapKey << "," << node->subtreeSize << ")";
-          if (node->left) {
-            buff2 << node->left->data << "(" << node->left->heapKey << "," << node->left->subtreeSize << ")";
-          } else {
-            buff2 << node.get() << "L";
-            out << "  \"" << buff2.str() << "\"[shape=point]\n";
-          }
-          out << "  \"" << buff1.str() << "\" -> \"" << buff2.str() << "\"[label=L]\n";
-          if (node->right) {
-            buff3 << node->right->data << "(" << node->right->heapKey << "," << node->right->subtreeSize << ")";
-          } else {
-            buff3 << node.get() << "R";
-            out << "  \"" << buff3.str() << "\"[shape=point]\n";
-          }
-          out << "  \"" << buff1.str() << "\" -> \"" << buff3.str() << "\"[label=R]\n";
+    std::ostream& write(TreapType const &version, std::ostream &out) {
+      this->writeDelta(version, [&out](void const *data, size_t size) {
+          out.write(static_cast<char const*>(data), size);
+          return out.good();
         });
-      out << "}\n";
       return out;
     }
 
+    // The number of deltas written so far.
+    uint64_t sequence() const {
+      return this->nextSequence;
+    }
+  };
+
+  /**
+   * Rebuilds the versions logged by a TreapDeltaWriter: load() the
+   * base snapshot, then apply() each delta in order. The nodes of
+   * the current version are kept in a table indexed by ID, which
+   * costs one hash table entry per node.
+   */
+  template <typename T, typename LessThan=std::less<T>,
+            typename Alloc=std::allocator<T>,
+            typename Summary=TreapNoSummary,
+            typename Layout=TreapDefaultLayout,
+            typename Priority=TreapRandomPriority>
+  class TreapDeltaReplayer {
+  public:
+    typedef Treap<T, LessThan, Alloc, Summary, Layout, Priority> TreapType;
+    typedef TreapDeltaRecord<T> Record;
+
+  private:
+    typedef typename TreapType::NodeType NodeType;
+    typedef typename TreapType::NodePtrType NodePtrType;
+
+    TreapType current;
+    std::unordered_map<uint64_t, NodePtrType> nodes;
+    uint64_t nextSequence;
+
+  public:
+    TreapDeltaReplayer() : nextSequence(0) { }
+
+    TreapDeltaReplayer(TreapDeltaReplayer const&) = delete;
+    TreapDeltaReplayer& operator=(TreapDeltaReplayer const&) = delete;
+
     /**
-     * Apply function 'f' to every element in the treap (in sorted
-     * order).
+     * Start from the snapshot of the writer's base version, written
+     * by Treap::save(). Returns false (leaving this replayer empty)
+     * if the snapshot is invalid.
+     *
+     * Cost: O(n)
      */
-    template <typename Func>
-    void for_each(Func f) const {
-      this->inorder(this->root, f);
+    bool load(std::istream &in) {
+      this->current = TreapType();
+      this->nodes.clear();
+      this->nextSequence = 0;
+      TreapSnapshotHeader header;
+      if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+          !header.valid(sizeof(typename TreapType::SnapshotRecord))) {
+        return false;
+      }
+      std::vector<typename TreapType::SnapshotRecord> records(header.count);
+      std::vector<NodePtrType> byIndex;
+      NodePtrType root;
+      if (!in.read(reinterpret_cast<char*>(records.data()),
+                   header.count * sizeof(records[0])) ||
+          !TreapType::buildFromRecords(records.data(), header, root, &byIndex)) {
+        return false;
+      }
+      this->nodes.reserve(byIndex.size());
+      for (size_t i = 0; i < byIndex.size(); ++i) {
+        this->nodes[i] = std::move(byIndex[i]);
+      }
+      this->current = TreapType(root);
+      return true;
     }
 
-    iterator begin() const {
-      std::vector<NodePtrType> ptrs;
-      auto tmp = this->root;
-      while (tmp) {
-        ptrs.push_back(tmp);
-        tmp = tmp->left;
+    /**
+     * Apply the next delta. Returns false, leaving the current
+     * version unchanged, if the delta is invalid, out of order, or
+     * refers to nodes that this replayer doesn't have.
+     *
+     * Cost: O(k), where k is the number of nodes in the delta.
+     */
+    bool apply(std::istream &in) {
+      const uint64_t NONE = TreapSnapshotHeader::NONE;
+      TreapDeltaHeader header;
+      if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+          !header.valid(sizeof(Record)) || header.sequence != this->nextSequence) {
+        return false;
+      }
+      std::vector<Record> records(header.count);
+      std::vector<uint64_t> dropped(header.dropped);
+      if (!in.read(reinterpret_cast<char*>(records.data()), header.count * sizeof(Record)) ||
+          !in.read(reinterpret_cast<char*>(dropped.data()), header.dropped * sizeof(uint64_t))) {
+        return false;
+      }
+
+      std::unordered_map<uint64_t, NodePtrType> fresh;
+      auto lookup = [this, &fresh, NONE](uint64_t id, NodePtrType &node) {
+        if (id == NONE) return true;
+        auto it = fresh.find(id);
+        if (it != fresh.end()) {
+          node = it->second;
+          return true;
+        }
+        auto old = this->nodes.find(id);
+        if (old == this->nodes.end()) return false;
+        node = old->second;
+        return true;
+      };
+      for (auto const &record : records) {
+        NodePtrType left, right;
+        if (record.id == NONE || this->nodes.count(record.id) || fresh.count(record.id) ||
+            !lookup(record.left, left) || !lookup(record.right, right)) {
+          return false;
+        }
+        NodePtrType node = NodeType::create(record.data, record.heapKey, 1,
+                                            std::move(left), std::move(right));
+        node->update();
+        fresh[record.id] = std::move(node);
+      }
+      NodePtrType root;
+      if (!lookup(header.root, root) || (root ? root->subtreeSize : 0) != header.size) {
+        return false;
+      }
+      for (auto id : dropped) {
+        if (!this->nodes.count(id)) return false;
       }
-      return iterator(std::move(ptrs), this->root);
+
+      for (auto id : dropped) {
+        this->nodes.erase(id);
+      }
+      this->nodes.insert(fresh.begin(), fresh.end());
+      this->current = TreapType(root);
+      ++this->nextSequence;
+      return true;
     }
 
-    iterator end() const {
-      return iterator({ }, this->root);
+    // The current version.
+    TreapType version() const {
+      return this->current;
     }
 
+    // The number of deltas applied since load().
+    uint64_t sequence() const {
+      return this->nextSequence;
+    }
   };
 
   template <typename T, typename LessThan=std::less<T> >